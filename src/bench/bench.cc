@@ -0,0 +1,361 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <unistd.h>
+
+#include "../mugen.h"
+#include "../util.h"
+#include "specgen.h"
+
+using Mugen::Bench::SpecParams;
+
+int printHelp(std::string const &progName, int ret = 0) {
+  std::cout << "Usage: " << progName << " spec [SPEC-OPTIONS]               Print a synthetic specification\n"
+            << "       " << progName << " run [OPTIONS] <file (.mu)> ...   Time the given specifications\n"
+            << "       " << progName << " sweep [OPTIONS] [SPEC-OPTIONS]    Time synthetic specifications, varying\n"
+            << "                                              one parameter at a time\n\n"
+            << "Options:\n"
+            << "  -r, --repeat N        Time every specification N times and report the medians (default 5).\n"
+            << "  -o, --output FILE     Append the results to FILE instead of printing them.\n"
+            << "  -j, --jobs N          Expand the microcode rules using N threads.\n"
+            << "  -a, --axis NAME       Only sweep the given parameter (see below).\n"
+            << "\nSpec options (sweep: the values that are kept fixed):\n"
+            << "  --address-bits N      Total number of address bits (default 18).\n"
+            << "  --flags N             Number of flag bits (default 4).\n"
+            << "  --opcodes N           Number of opcodes (default 64).\n"
+            << "  --signals N           Number of signals (default 24).\n"
+            << "  --rules N             Number of rules, excluding the catch rule (default 4096).\n"
+            << "  --wildcards D         Fraction of the flags that rules leave as wildcard (default 0.25).\n"
+            << "  --chips N             Number of rom chips (default 3).\n"
+            << "  --segment-bits N      Number of segment bits (default 0).\n"
+            << "  --macros N            Number of macros (default 8).\n"
+            << "  --seed N              Seed of the generator (default 1).\n"
+            << "\nResults are written as one JSON object per specification, containing the median time\n"
+            << "in milliseconds of each phase of the generation and of each writer.\n";
+  return ret;
+}
+
+struct Settings {
+  SpecParams params;
+  Mugen::Options opt;
+  size_t repeat = 5;
+  std::string output;
+  std::string axis;
+  std::vector<std::string> files;
+};
+
+// Parses the options in args into settings. Returns an error message when an option is invalid,
+// or an empty string on success.
+std::string parseOptions(std::vector<std::string> const &args, Settings &settings) {
+  auto &params = settings.params;
+  std::map<std::string, size_t *> sizes = {
+    {"--address-bits", &params.addressBits},
+    {"--flags", &params.flags},
+    {"--opcodes", &params.opcodes},
+    {"--signals", &params.signals},
+    {"--rules", &params.rules},
+    {"--chips", &params.chips},
+    {"--segment-bits", &params.segmentBits},
+    {"--macros", &params.macros},
+    {"--repeat", &settings.repeat},
+    {"-r", &settings.repeat},
+    {"--jobs", &settings.opt.jobs},
+    {"-j", &settings.opt.jobs}
+  };
+
+  for (size_t idx = 0; idx != args.size(); ++idx) {
+    std::string const &flag = args[idx];
+    if (flag[0] != '-') {
+      settings.files.push_back(flag);
+      continue;
+    }
+    if (idx == args.size() - 1) {
+      return "no argument to " + flag + " option.";
+    }
+
+    std::string const &arg = args[++idx];
+    if (flag == "-o" || flag == "--output") settings.output = arg;
+    else if (flag == "-a" || flag == "--axis") settings.axis = arg;
+    else if (flag == "--wildcards") {
+      try {
+        params.wildcards = std::stod(arg);
+      }
+      catch (...) {
+        return "argument passed to --wildcards must be a number.";
+      }
+    }
+    else if (flag == "--seed") {
+      if (!stringToInt(arg, params.seed)) return "argument passed to --seed must be an integer.";
+    }
+    else if (sizes.contains(flag)) {
+      long long value;
+      if (!stringToInt(arg, value) || value < 0) return "argument passed to " + flag + " must be a non-negative integer.";
+      *sizes[flag] = value;
+    }
+    else return "unknown option " + flag + ".";
+  }
+
+  if (settings.repeat == 0) return "argument passed to --repeat (-r) must be positive.";
+  return "";
+}
+
+double median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  size_t const mid = values.size() / 2;
+  return (values.size() % 2) ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+double elapsed(Mugen::Clock::time_point begin, Mugen::Clock::time_point end) {
+  return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+// Times every writer on the result, writing to files in dir. Returns the time per writer format.
+std::map<std::string, double> timeWriters(Mugen::Result const &result, std::filesystem::path const &dir) {
+  std::map<std::string, double> times;
+  
+  auto time = [&]<typename Writer>(Writer *) {
+    std::string const ext = Writer("").extensions()[0];
+    Writer writer((dir / ("bench" + ext)).string());
+    auto const begin = Mugen::Clock::now();
+    bool const success = writer.write(result).success;
+    auto const end = Mugen::Clock::now();
+    if (success) times[writer.format()] = elapsed(begin, end);
+  };
+  
+  [&]<typename ... Writers>(std::tuple<Writers ...> *) {
+    (time(static_cast<Writers *>(nullptr)), ...);
+  }(static_cast<Mugen::Writers *>(nullptr));
+  
+  for (auto const &entry: std::filesystem::directory_iterator(dir))
+    std::filesystem::remove(entry.path());
+  return times;
+}
+
+std::string quote(std::string const &str) {
+  std::string result = "\"";
+  for (char c: str) {
+    if (c == '"' || c == '\\') result += '\\';
+    result += c;
+  }
+  return result + '"';
+}
+
+std::string toJson(std::map<std::string, double> const &values) {
+  std::ostringstream out;
+  out << '{';
+  for (auto it = values.begin(); it != values.end(); ++it)
+    out << (it == values.begin() ? "" : ", ") << quote(it->first) << ": " << it->second;
+  out << '}';
+  return out.str();
+}
+
+// Generates the specification settings.repeat times and returns the medians of the timings as a
+// JSON object, or an empty string when the specification contains errors. Extra fields (such as
+// the parameters of a synthetic specification) are inserted at the start of the object.
+std::string timeSpec(std::string_view source, std::string const &name, std::string const &extra,
+                     Settings const &settings, std::filesystem::path const &dir) {
+  std::map<std::string, std::vector<double>> phases;
+  std::map<std::string, std::vector<double>> writers;
+  std::vector<double> totals;
+  size_t addresses = 0;
+  size_t rules = 0;
+  
+  Mugen::Options opt = settings.opt;
+  std::map<std::string, double> current;
+  opt.onPhase = [&](char const *phase, Mugen::Clock::time_point begin, Mugen::Clock::time_point end) {
+    current[phase] += elapsed(begin, end);
+  };
+  opt.onDiagnostic = [](Mugen::Diagnostic const &diag) {
+    if (diag.severity == Mugen::Diagnostic::Severity::ERROR)
+      std::cerr << diag.file << ":" << diag.line << ": ERROR: " << diag.message << '\n';
+  };
+  
+  for (size_t run = 0; run != settings.repeat; ++run) {
+    current.clear();
+    auto const begin = Mugen::Clock::now();
+    Mugen::Result result;
+    try {
+      result = Mugen::generateFromSource(source, name, opt);
+    }
+    catch (Mugen::Error const &) {
+      return "";
+    }
+    totals.push_back(elapsed(begin, Mugen::Clock::now()));
+    
+    for (auto const &[phase, ms]: current) phases[phase].push_back(ms);
+    for (auto const &[format, ms]: timeWriters(result, dir)) writers[format].push_back(ms);
+    addresses = size_t{1} << result.address.total_address_bits;
+    rules = result.rules.size();
+  }
+  
+  auto medians = [](std::map<std::string, std::vector<double>> const &times) {
+    std::map<std::string, double> result;
+    for (auto const &[key, values]: times) result[key] = median(values);
+    return result;
+  };
+  
+  std::ostringstream out;
+  out << "{\"spec\": " << quote(name) << ", " << extra
+      << "\"addresses\": " << addresses
+      << ", \"rules\": " << rules
+      << ", \"repeat\": " << settings.repeat
+      << ", \"jobs\": " << settings.opt.jobs
+      << ", \"total_ms\": " << median(totals)
+      << ", \"phases\": " << toJson(medians(phases))
+      << ", \"writers\": " << toJson(medians(writers))
+      << "}";
+  return out.str();
+}
+
+std::string paramsJson(SpecParams const &params) {
+  std::ostringstream out;
+  out << "{\"address_bits\": " << params.addressBits
+      << ", \"flags\": " << params.flags
+      << ", \"opcodes\": " << params.opcodes
+      << ", \"signals\": " << params.signals
+      << ", \"rules\": " << params.rules
+      << ", \"wildcards\": " << params.wildcards
+      << ", \"chips\": " << params.chips
+      << ", \"segment_bits\": " << params.segmentBits
+      << ", \"macros\": " << params.macros
+      << ", \"seed\": " << params.seed
+      << "}";
+  return out.str();
+}
+
+// A parameter of the synthetic specifications and the values it takes during a sweep. Some axes
+// adjust other parameters as well, e.g. the number of chips grows with the number of signals.
+struct Axis {
+  std::string name;
+  std::vector<double> values;
+  std::function<void(SpecParams &, double)> apply;
+};
+
+std::vector<Axis> const &axes() {
+  static std::vector<Axis> const result = {
+    {"address-bits", {12, 14, 16, 18, 20, 22}, [](SpecParams &p, double v) { p.addressBits = v; }},
+    {"flags", {0, 2, 4, 6, 8}, [](SpecParams &p, double v) { p.flags = v; }},
+    {"opcodes", {4, 16, 64, 256, 1024}, [](SpecParams &p, double v) { p.opcodes = v; }},
+    {"signals", {8, 16, 32, 48, 64}, [](SpecParams &p, double v) {
+      p.signals = v;
+      p.chips = std::max<size_t>(p.chips, (p.signals + 7) / 8);
+    }},
+    {"rules", {256, 1024, 4096, 16384, 65536}, [](SpecParams &p, double v) { p.rules = v; }},
+    {"wildcards", {0, 0.25, 0.5, 0.75, 1}, [](SpecParams &p, double v) { p.wildcards = v; }},
+    {"chips", {1, 2, 4, 8}, [](SpecParams &p, double v) {
+      p.chips = v;
+      p.signals = 8 * p.chips;
+    }},
+    {"segment-bits", {0, 1, 2, 3}, [](SpecParams &p, double v) {
+      p.segmentBits = v;
+      p.chips = 1;
+      p.signals = 8 << p.segmentBits;
+    }}
+  };
+  return result;
+}
+
+int main(int argc, char **argv) {
+  std::string const progName = argv[0];
+  if (argc < 2) return printHelp(progName, 1);
+  
+  std::string const mode = argv[1];
+  if (mode == "-h" || mode == "--help") return printHelp(progName);
+  if (mode != "spec" && mode != "run" && mode != "sweep") {
+    std::cerr << "ERROR: unknown mode \"" << mode << "\".\n";
+    return printHelp(progName, 1);
+  }
+  
+  Settings settings;
+  std::string const msg = parseOptions(std::vector<std::string>(argv + 2, argv + argc), settings);
+  if (!msg.empty()) {
+    std::cerr << "ERROR: " << msg << '\n';
+    return 1;
+  }
+  if ((mode == "run") == settings.files.empty()) {
+    std::cerr << "ERROR: " << (mode == "run" ? "no specification files given." : "unexpected argument \"" + settings.files[0] + "\".") << '\n';
+    return 1;
+  }
+  
+  std::ofstream file;
+  if (!settings.output.empty()) {
+    file.open(settings.output, std::ios::app);
+    if (!file) {
+      std::cerr << "ERROR: could not open output file \"" << settings.output << "\".\n";
+      return 1;
+    }
+  }
+  std::ostream &out = settings.output.empty() ? std::cout : file;
+  
+  if (mode == "spec") {
+    try {
+      out << Mugen::Bench::generateSpec(settings.params);
+    }
+    catch (std::invalid_argument const &e) {
+      std::cerr << "ERROR: " << e.what() << '\n';
+      return 1;
+    }
+    return 0;
+  }
+  
+  std::filesystem::path const dir = std::filesystem::temp_directory_path() / ("mugen-bench-" + std::to_string(getpid()));
+  std::filesystem::create_directories(dir);
+  
+  int ret = 0;
+  auto report = [&](std::string const &json, std::string const &name) {
+    if (json.empty()) {
+      std::cerr << "ERROR: could not generate " << name << ".\n";
+      ret = 1;
+      return;
+    }
+    out << json << std::endl;
+  };
+  
+  if (mode == "run") {
+    for (std::string const &filename: settings.files) {
+      MappedFile spec(filename);
+      if (!spec) {
+        std::cerr << "ERROR: could not open file \"" << filename << "\".\n";
+        ret = 1;
+        continue;
+      }
+      report(timeSpec(spec.view(), filename, "", settings, dir), filename);
+    }
+  }
+  else {
+    bool found = false;
+    for (Axis const &axis: axes()) {
+      if (!settings.axis.empty() && settings.axis != axis.name) continue;
+      found = true;
+      
+      for (double value: axis.values) {
+        SpecParams params = settings.params;
+        axis.apply(params, value);
+        std::string source;
+        try {
+          source = Mugen::Bench::generateSpec(params);
+        }
+        catch (std::invalid_argument const &e) {
+          std::cerr << "WARNING: skipping " << axis.name << " = " << value << ": " << e.what() << '\n';
+          continue;
+        }
+        
+        std::ostringstream name;
+        name << "synthetic-" << axis.name << "-" << value;
+        std::string const extra = "\"axis\": " + quote(axis.name) + ", \"params\": " + paramsJson(params) + ", ";
+        report(timeSpec(source, name.str(), extra, settings, dir), name.str());
+      }
+    }
+    if (!found) {
+      std::cerr << "ERROR: unknown axis \"" << settings.axis << "\".\n";
+      ret = 1;
+    }
+  }
+  
+  std::filesystem::remove_all(dir);
+  return ret;
+}
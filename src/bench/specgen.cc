@@ -0,0 +1,120 @@
+#include <sstream>
+#include <random>
+#include <algorithm>
+#include <numeric>
+#include <unordered_set>
+#include <stdexcept>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+
+#include "specgen.h"
+
+namespace Mugen::Bench {
+
+  // Picks count distinct values from [0, n) in ascending order (Floyd's algorithm, or a partial
+  // shuffle when most of the values are picked anyway)
+  std::vector<uint64_t> sample(uint64_t n, uint64_t count, std::mt19937_64 &rng) {
+    std::vector<uint64_t> result;
+    if (count * 2 >= n) {
+      result.resize(n);
+      std::iota(result.begin(), result.end(), 0);
+      std::shuffle(result.begin(), result.end(), rng);
+      result.resize(count);
+    }
+    else {
+      std::unordered_set<uint64_t> picked;
+      for (uint64_t j = n - count; j != n; ++j) {
+        uint64_t const value = std::uniform_int_distribution<uint64_t>(0, j)(rng);
+        if (!picked.insert(value).second) picked.insert(j);
+      }
+      result.assign(picked.begin(), picked.end());
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+
+  std::string generateSpec(SpecParams &params) {
+    std::mt19937_64 rng(params.seed);
+
+    params.opcodes = std::max<size_t>(params.opcodes, 1);
+    params.chips = std::max<size_t>(params.chips, 1);
+    size_t const opcodeBits = std::max<size_t>(std::bit_width(params.opcodes - 1), 1);
+    size_t const usedBits = opcodeBits + params.flags + params.segmentBits;
+    if (params.addressBits > 40 || params.addressBits <= usedBits)
+      throw std::invalid_argument("the opcode, flag and segment bits leave no room for the cycle bits.");
+    size_t const cycleBits = params.addressBits - usedBits;
+
+    params.signals = std::clamp<size_t>(params.signals, 1, std::min<size_t>(64, params.chips * (8 << params.segmentBits)));
+    params.macros = std::min(params.macros, params.signals / 2);
+    params.wildcards = std::clamp(params.wildcards, 0.0, 1.0);
+
+    // Every rule fixes the opcode, the cycle and the same subset of the flags. Rules are picked at
+    // random from all combinations of these, so they never overlap.
+    size_t const fixedFlags = std::lround((1 - params.wildcards) * params.flags);
+    std::vector<size_t> flagBits(params.flags);
+    std::iota(flagBits.begin(), flagBits.end(), 0);
+    std::shuffle(flagBits.begin(), flagBits.end(), rng);
+    flagBits.resize(fixedFlags);
+
+    uint64_t const nCycles = uint64_t{1} << cycleBits;
+    uint64_t const nCombinations = params.opcodes * nCycles << fixedFlags;
+    params.rules = std::min<uint64_t>(params.rules, nCombinations);
+
+    std::ostringstream out;
+    out << "# Synthetic specification: " << params.addressBits << " address bits, "
+        << params.rules << " rules, seed " << params.seed << "\n\n";
+    out << "[rom] { " << (size_t{1} << params.addressBits) << " x 8 x " << params.chips << " }\n\n";
+    out << "[address] {\n"
+        << "  cycle: " << cycleBits << "\n"
+        << "  opcode: " << opcodeBits << "\n"
+        << "  flags: " << params.flags << "\n"
+        << "  segment: " << params.segmentBits << "\n"
+        << "}\n\n";
+
+    out << "[signals] {\n";
+    for (size_t idx = 0; idx != params.signals; ++idx) out << "  S" << idx << '\n';
+    out << "}\n\n";
+
+    auto signal = [&]() {
+      return std::uniform_int_distribution<size_t>(0, params.signals - 1)(rng);
+    };
+
+    if (params.macros > 0) {
+      out << "[macros] {\n";
+      for (size_t idx = 0; idx != params.macros; ++idx)
+        out << "  M" << idx << " = S" << signal() << ", S" << signal() << '\n';
+      out << "}\n\n";
+    }
+
+    out << "[opcodes] {\n";
+    for (size_t idx = 0; idx != params.opcodes; ++idx)
+      out << "  OP" << idx << " = 0x" << std::hex << idx << std::dec << '\n';
+    out << "}\n\n";
+
+    out << "[microcode] {\n";
+    std::string flags(params.flags, 'x');
+    for (uint64_t combination: sample(nCombinations, params.rules, rng)) {
+      uint64_t const flagValue = combination & ((uint64_t{1} << fixedFlags) - 1);
+      uint64_t const slot = combination >> fixedFlags;
+      for (size_t bit = 0; bit != fixedFlags; ++bit)
+        flags[flagBits[bit]] = ((flagValue >> bit) & 1) ? '1' : '0';
+
+      out << "  OP" << (slot / nCycles) << ':' << (slot % nCycles);
+      if (params.flags > 0) out << ':' << flags;
+      out << " ->";
+
+      size_t const nSignals = std::uniform_int_distribution<size_t>(1, 4)(rng);
+      for (size_t idx = 0; idx != nSignals; ++idx) {
+        out << (idx == 0 ? " " : ", ");
+        if (params.macros > 0 && rng() % 5 == 0) out << 'M' << (rng() % params.macros);
+        else out << 'S' << signal();
+      }
+      out << '\n';
+    }
+    out << "  catch -> S0\n";
+    out << "}\n";
+
+    return out.str();
+  }
+}
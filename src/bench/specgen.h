@@ -0,0 +1,31 @@
+#ifndef SPECGEN_H
+#define SPECGEN_H
+
+#include <string>
+#include <cstddef>
+
+namespace Mugen::Bench {
+
+  // Parameters of a synthetic specification. The address consists of the segment, flag and
+  // opcode bits; the remaining address bits are used for the cycle.
+  struct SpecParams {
+    size_t addressBits = 18;
+    size_t flags = 4;
+    size_t opcodes = 64;
+    size_t signals = 24;
+    size_t rules = 4096;
+    double wildcards = 0.25;  // fraction of the flag bits left as wildcard by each rule
+    size_t chips = 3;
+    size_t segmentBits = 0;
+    size_t macros = 8;
+    unsigned seed = 1;
+  };
+
+  // Generates a valid specification with non-overlapping rules and a catch rule. The parameters
+  // are updated to the values that were actually used: the number of signals is limited by the
+  // size of the roms, and the number of rules by the number of distinct rules that fit.
+  // Throws std::invalid_argument when the address does not leave at least one cycle bit.
+  std::string generateSpec(SpecParams &params);
+}
+
+#endif
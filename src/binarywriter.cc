@@ -1,20 +1,64 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "mugen.h"
 
+std::string Mugen::BinaryFileWriter::filename(size_t idx, size_t count) const {
+  return _filename + ((count > 1) ? ("." + std::to_string(idx)) : "");
+}
+
+// Creates the output file with its final size and maps it into memory. When this fails, the image
+// is allocated on the heap instead and written to the file by write().
+Mugen::Image Mugen::BinaryFileWriter::allocate(size_t idx, size_t count, size_t size) {
+  if (_mapped.size() < count) _mapped.resize(count);
+  _mapped[idx] = nullptr;
+  
+  std::string const file = filename(idx, count);
+  int const fd = open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return Image(size);
+  
+  void *ptr = MAP_FAILED;
+  if (size > 0 && ftruncate(fd, size) == 0) 
+    ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) return Image(size);
+  
+  auto *data = static_cast<unsigned char *>(ptr);
+  _mapped[idx] = data;
+  return Image(data, size, [](unsigned char *data, size_t size) {
+    munmap(data, size);
+  });
+}
+
+void Mugen::BinaryFileWriter::flush(size_t begin, size_t end) {
+  size_t const pageSize = sysconf(_SC_PAGESIZE);
+  size_t const first = begin - begin % pageSize;
+  for (unsigned char *data: _mapped) {
+    if (!data) continue;
+    msync(data + first, end - first, MS_SYNC);
+    madvise(data + first, end - first, MADV_DONTNEED);
+  }
+}
+
 Mugen::WriteResult Mugen::BinaryFileWriter::write(Result const &result) {
   std::vector<std::string> files;
   for (size_t idx = 0; idx != result.images.size(); ++idx) {
-    std::string filename = _filename + ((result.images.size() > 1) ? ("." + std::to_string(idx)) : "");
-    std::ofstream out(filename, std::ios::binary);
+    std::string file = filename(idx, result.images.size());
+    files.push_back(file);
+    
+    // Mapped images have already been written in place
+    if (idx < _mapped.size() && _mapped[idx] == result.images[idx].data()) continue;
+    
+    std::ofstream out(file, std::ios::binary);
     if (!out) {
-      std::cerr << "ERROR: Could not open output file \"" << filename << "\".";
-      return {false, ""};
+      return {false, "could not open output file \"" + file + "\"."};
     }
       
-    files.push_back(filename);
     out.write(reinterpret_cast<char const *>(result.images[idx].data()), result.images[idx].size());
     out.close();
   }
@@ -28,6 +72,7 @@ Mugen::WriteResult Mugen::BinaryFileWriter::write(Result const &result) {
 	   << " (" << result.images[idx].size() << " bytes)\n";
   }
   
-  return {true, report.str()};
+  size_t bytes = 0;
+  for (Image const &image: result.images) bytes += image.size();
+  return {true, report.str(), bytes};
 }
-
@@ -4,6 +4,7 @@
 #include <sstream>
 #include <cassert>
 #include <filesystem>
+#include <algorithm>
 
 #include "mugen.h"
 
@@ -59,22 +60,384 @@ namespace Mugen {
 )";
 
 
+std::string compressedHeader = R"(
+/*
+  Generated by Mugen, based on specification file @SPEC_FILE.
+  See https://github.com/jorenheit/mugen.
+
+  The images are run-length encoded into a single array. A control byte c below 128 is followed
+  by c + 1 literal bytes; a control byte c of 128 or more is followed by a single byte, which is
+  repeated c - 125 times. The bytes of an image are decompressed one at a time:
+
+    mugen_stream stream;
+    mugen_stream_init(&stream, image);
+    for (size_t address = 0; address != IMAGE_SIZE; ++address)
+      program(address, mugen_stream_next(&stream));
+
+  To keep the compressed data in program memory, define MUGEN_STORAGE and MUGEN_READ_BYTE when
+  compiling both files, e.g. as PROGMEM and pgm_read_byte on AVR.
+*/
+
+#ifndef MUGEN_IMAGES_H
+#define MUGEN_IMAGES_H
+
+#ifndef MUGEN_STORAGE
+#define MUGEN_STORAGE
+#endif
+#ifndef MUGEN_READ_BYTE
+#define MUGEN_READ_BYTE(ptr) (*(ptr))
+#endif
+
+#ifdef __cplusplus
+#include <cstddef>
+#define COMPRESSED_VAR compressed_images
+namespace Mugen {
+
+  constexpr size_t IMAGE_SIZE = @IMAGE_SIZE;
+  constexpr size_t N_IMAGES = @N_IMAGES;
+  constexpr size_t COMPRESSED_SIZE = @COMPRESSED_SIZE;
+#else
+#include <stddef.h>
+#define COMPRESSED_VAR mugen_compressed_images
+#define IMAGE_SIZE @IMAGE_SIZE
+#define N_IMAGES @N_IMAGES
+#define COMPRESSED_SIZE @COMPRESSED_SIZE
+#endif
+
+  extern unsigned char const COMPRESSED_VAR[COMPRESSED_SIZE];
+  static const size_t COMPRESSED_OFFSETS[N_IMAGES] = {@OFFSETS};
+
+  typedef struct {
+    unsigned char const *src;
+    size_t remaining;
+    unsigned char literal;
+    unsigned char value;
+  } mugen_stream;
+
+  static inline void mugen_stream_init(mugen_stream *stream, size_t image) {
+    stream->src = COMPRESSED_VAR + COMPRESSED_OFFSETS[image];
+    stream->remaining = 0;
+    stream->literal = 0;
+    stream->value = 0;
+  }
+
+  static inline unsigned char mugen_stream_next(mugen_stream *stream) {
+    if (stream->remaining == 0) {
+      unsigned char const control = MUGEN_READ_BYTE(stream->src++);
+      stream->literal = (control < 128);
+      if (stream->literal) stream->remaining = control + 1;
+      else {
+        stream->remaining = control - 125;
+        stream->value = MUGEN_READ_BYTE(stream->src++);
+      }
+    }
+    --stream->remaining;
+    return stream->literal ? MUGEN_READ_BYTE(stream->src++) : stream->value;
+  }
+
+#ifdef __cplusplus
+}
+#endif
+#endif // MUGEN_IMAGES_H
+)";
+
+
+std::string compressedSource = R"(
+/*
+  Generated by Mugen, based on specification file @SPEC_FILE.
+  See https://github.com/jorenheit/mugen.
+*/
+
+#include "@HEADER_FILE"
+#ifdef __cplusplus
+namespace Mugen {
+#endif
+
+  unsigned char const COMPRESSED_VAR[COMPRESSED_SIZE] MUGEN_STORAGE = {
+@ARRAYS
+  };
+
+#ifdef __cplusplus
+}
+#endif
+)";
+
+
+std::string tableHeader = R"(
+/*
+  Generated by Mugen, based on specification file @SPEC_FILE.
+  See https://github.com/jorenheit/mugen.
+
+  Contains the control word of every logical address: bit i of a control word is set when signal i
+  is active. The logical address is composed of the opcode, cycle and flags (see address()); segment
+  bits are not part of it.
+*/
+
+#ifndef MUGEN_CONTROL_WORDS_H
+#define MUGEN_CONTROL_WORDS_H
+
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstdint>
+#define CONTROL_WORD_T control_word_t
+#define CONTROL_WORDS_VAR control_words
+namespace Mugen {
+
+  typedef std::uint@WORD_BITS_t control_word_t;
+  constexpr size_t N_ADDRESSES = @N_ADDRESSES;
+  extern control_word_t const control_words[N_ADDRESSES];
+
+  namespace signals {
+@CPP_SIGNALS
+  }
+
+  namespace opcodes {
+@CPP_OPCODES
+  }
+
+  namespace flags {
+@CPP_FLAGS
+  }
+
+  constexpr size_t address(size_t opcode, size_t cycle, size_t flags = 0) {
+    return @ADDRESS;
+  }
+
+  inline control_word_t control_word(size_t opcode, size_t cycle, size_t flags = 0) {
+    return control_words[address(opcode, cycle, flags)];
+  }
+}
+#else
+#include <stddef.h>
+#include <stdint.h>
+#define CONTROL_WORD_T mugen_control_word_t
+#define CONTROL_WORDS_VAR mugen_control_words
+
+typedef uint@WORD_BITS_t mugen_control_word_t;
+#define N_ADDRESSES @N_ADDRESSES
+extern mugen_control_word_t const mugen_control_words[N_ADDRESSES];
+
+@C_SIGNALS
+@C_OPCODES
+@C_FLAGS
+static inline size_t mugen_address(size_t opcode, size_t cycle, size_t flags) {
+  return @ADDRESS;
+}
+
+static inline mugen_control_word_t mugen_control_word(size_t opcode, size_t cycle, size_t flags) {
+  return mugen_control_words[mugen_address(opcode, cycle, flags)];
+}
+#endif
+#endif // MUGEN_CONTROL_WORDS_H
+)";
+
+
+std::string tableSource = R"(
+/*
+  Generated by Mugen, based on specification file @SPEC_FILE.
+  See https://github.com/jorenheit/mugen.
+*/
+
+#include "@HEADER_FILE"
+#ifdef __cplusplus
+namespace Mugen {
+#endif
+
+  CONTROL_WORD_T const CONTROL_WORDS_VAR[N_ADDRESSES] = {
+@ARRAYS
+  };
+
+#ifdef __cplusplus
+}
+#endif
+)";
+
+
+std::string constexprHeader = R"(
+/*
+  Generated by Mugen, based on specification file @SPEC_FILE.
+  See https://github.com/jorenheit/mugen.
+
+  Contains the control word of every logical address: bit i of a control word is set when signal i
+  is active. The logical address is composed of the opcode, cycle and flags (see address()); segment
+  bits are not part of it. Everything is constexpr, so the microcode can be inspected at compile time:
+
+    static_assert(Mugen::decode(opcode, cycle, flags).contains(Mugen::signals::SIGNAL));
+*/
+
+#ifndef MUGEN_CONTROL_WORDS_H
+#define MUGEN_CONTROL_WORDS_H
+
+#if !defined(__cplusplus) || !defined(__cpp_consteval)
+#error "This header requires C++20."
+#endif
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace Mugen {
+
+  typedef std::uint@WORD_BITS_t control_word_t;
+  inline constexpr size_t N_ADDRESSES = @N_ADDRESSES;
+  inline constexpr size_t N_SIGNALS = @N_SIGNALS;
+
+  inline constexpr std::array<control_word_t, N_ADDRESSES> control_words = {
+@ARRAYS
+  };
+
+  // Names of the signals, indexed by their bit in the control word ("" for empty signals)
+  inline constexpr std::array<std::string_view, N_SIGNALS> signal_names = {
+    @SIGNAL_NAMES
+  };
+
+  namespace signals {
+@CPP_SIGNALS
+  }
+
+  namespace opcodes {
+@CPP_OPCODES
+  }
+
+  namespace flags {
+@CPP_FLAGS
+  }
+
+  constexpr size_t address(size_t opcode, size_t cycle, size_t flags = 0) {
+    return @ADDRESS;
+  }
+
+  constexpr control_word_t control_word(size_t opcode, size_t cycle, size_t flags = 0) {
+    return control_words[address(opcode, cycle, flags)];
+  }
+
+  // The signals that are active in a control word
+  struct signal_set {
+    control_word_t bits = 0;
+
+    constexpr bool contains(control_word_t signals) const { return (bits & signals) == signals; }
+    constexpr bool empty() const { return bits == 0; }
+    constexpr size_t size() const { return std::popcount(bits); }
+    constexpr bool operator==(signal_set const &) const = default;
+
+    // Name of the idx'th active signal, counting from the least significant bit
+    constexpr std::string_view name(size_t idx) const {
+      for (size_t bit = 0; bit != N_SIGNALS; ++bit) {
+        if (((bits >> bit) & 1) && idx-- == 0) return signal_names[bit];
+      }
+      return {};
+    }
+  };
+
+  consteval signal_set decode(size_t opcode, size_t cycle, size_t flags = 0) {
+    return {control_word(opcode, cycle, flags)};
+  }
+}
+
+#endif // MUGEN_CONTROL_WORDS_H
+)";
+
+
+namespace {
+
+  // Name of the empty signals, which are declared with a dash
+  std::string const s_emptySignal = "__EMPTY__";
+
+  // Run-length encoding of the first size bytes of the image, as described in compressedHeader.
+  // Runs of at least 3 equal bytes are repeated; everything in between is stored as literals.
+  void compress(Mugen::Image const &image, size_t size, std::vector<unsigned char> &out) {
+    size_t literals = 0;    // start of the pending literals
+    size_t idx = 0;
+
+    auto flushLiterals = [&](size_t end) {
+      while (literals != end) {
+        size_t const n = std::min<size_t>(end - literals, 128);
+        out.push_back(n - 1);
+        out.insert(out.end(), image.begin() + literals, image.begin() + literals + n);
+        literals += n;
+      }
+    };
+
+    while (idx != size) {
+      size_t run = 1;
+      while (idx + run != size && run != 130 && image[idx + run] == image[idx]) ++run;
+      if (run < 3) {
+        idx += run;
+        continue;
+      }
+
+      flushLiterals(idx);
+      out.push_back(run + 125);
+      out.push_back(image[idx]);
+      idx += run;
+      literals = idx;
+    }
+    flushLiterals(size);
+  }
+
+  // Formats the bytes as the body of an array initializer, 20 bytes per line
+  void formatBytes(std::ostream &out, unsigned char const *data, size_t n) {
+    out << "      ";
+    for (size_t byte = 0; byte != n; ++byte) {
+      out << std::setw(3) << std::setfill(' ') << (int)data[byte] << ", ";
+      if ((byte + 1) % 20 == 0) out << "\n      ";
+    }
+  }
+
+  // Formats the words as hexadecimal numbers in the body of an array initializer
+  void formatWords(std::ostream &out, std::vector<uint64_t> const &words, size_t wordBits) {
+    size_t const digits = wordBits / 4;
+    size_t const perLine = std::max<size_t>(1, 96 / (digits + 4));
+    out << "      " << std::hex << std::setfill('0');
+    for (size_t idx = 0; idx != words.size(); ++idx) {
+      out << "0x" << std::setw(digits) << words[idx] << ", ";
+      if ((idx + 1) % perLine == 0 && idx + 1 != words.size()) out << "\n      ";
+    }
+    out << std::dec << '\n';
+  }
+
+  // The control word of every logical address, i.e. with the segment bits left out
+  std::vector<uint64_t> controlWords(Mugen::Result const &result) {
+    auto const &address = result.address;
+    size_t const logicalBits = address.total_address_bits - address.segment_bits;
+    size_t const low = (size_t{1} << address.segment_bits_start) - 1;
+
+    std::vector<uint64_t> words(size_t{1} << logicalBits);
+    for (size_t logical = 0; logical != words.size(); ++logical) {
+      size_t const physical = (logical & low) | ((logical & ~low) << address.segment_bits);
+      words[logical] = Mugen::controlWordAt(result, physical);
+    }
+    return words;
+  }
+
+  // Expression that composes the logical address from the opcode, cycle and flags arguments
+  std::string addressExpression(Mugen::AddressMapping const &address) {
+    auto field = [&](std::string const &name, size_t bits, size_t start) {
+      if (bits == 0) return std::string{};
+      if (address.segment_bits > 0 && start > address.segment_bits_start) start -= address.segment_bits;
+      std::ostringstream oss;
+      oss << "((" << name << " & 0x" << std::hex << ((size_t{1} << bits) - 1) << std::dec << ") << " << start << ")";
+      return oss.str();
+    };
+
+    std::string expr;
+    for (std::string const &term: {field("opcode", address.opcode_bits, address.opcode_bits_start),
+                                   field("cycle", address.cycle_bits, address.cycle_bits_start),
+                                   field("flags", address.flag_bits, address.flag_bits_start)}) {
+      if (term.empty()) continue;
+      expr += (expr.empty() ? "" : " | ") + term;
+    }
+    return expr.empty() ? "0" : expr;
+  }
+}
+
 Mugen::WriteResult Mugen::CPPWriter::write(Result const &result) {
   std::string const specFilename = std::filesystem::path(result.specificationFilename).filename();
   std::string const headerFilename = std::filesystem::path(_filename).replace_extension(".h").string();
   size_t const nImages = result.images.size();
-  size_t const nBytes = (1 << result.address.total_address_bits);
-
-  // Generate array-string
-  std::ostringstream oss;
-  for (size_t idx = 0; idx != nImages; ++idx) {
-    oss << "    {\n      ";
-    for (size_t byte = 0; byte != nBytes; ++byte) {
-      oss << std::setw(3) << std::setfill(' ') << (int)result.images[idx][byte] << ", ";
-      if ((byte + 1) % 20 == 0) oss << "\n      ";
-    }
-    oss << "\n    },\n";
-  }
+  size_t const nBytes = (size_t{1} << result.address.total_address_bits);
 
   // lambda to replace markers in the source templates
   auto replaceMarker = [&](std::string &target, std::string const &marker, std::string const &replacement) {
@@ -85,35 +448,127 @@ Mugen::WriteResult Mugen::CPPWriter::write(Result const &result) {
     }
   };
 
-  // Replace markers
-  replaceMarker(header, "@SPEC_FILE", specFilename);
-  replaceMarker(header, "@IMAGE_SIZE", std::to_string(nBytes));
-  replaceMarker(header, "@N_IMAGES", std::to_string(nImages));
+  // Generate array-string and replace markers in copies of the templates, so that the writer can
+  // be used more than once
+  std::ostringstream oss;
+  std::string headerText;
+  std::string sourceText;
+  std::ostringstream summary;
+  if (_style == Style::TABLE || _style == Style::CONSTEXPR) {
+    std::string const qualifier = (_style == Style::CONSTEXPR) ? "inline constexpr" : "constexpr";
+    std::vector<uint64_t> const words = controlWords(result);
+    size_t wordBits = 8;
+    while (wordBits < result.signals.size()) wordBits *= 2;
+    formatWords(oss, words, wordBits);
+
+    std::string cppSignals, cSignals, signalNames;
+    for (size_t idx = 0; idx != result.signals.size(); ++idx) {
+      std::string const &name = result.signals[idx];
+      bool const empty = (name == s_emptySignal);
+      signalNames += (idx ? ", \"" : "\"") + (empty ? std::string{} : name) + "\"";
+      if (empty) continue;
+      cppSignals += "    " + qualifier + " control_word_t " + name + " = control_word_t{1} << " + std::to_string(idx) + ";\n";
+      cSignals += "#define MUGEN_SIGNAL_" + name + " ((mugen_control_word_t)1 << " + std::to_string(idx) + ")\n";
+    }
+
+    std::vector<std::pair<size_t, std::string>> opcodes;
+    for (auto const &[name, value]: result.opcodes) opcodes.emplace_back(value, name);
+    std::sort(opcodes.begin(), opcodes.end());
+
+    std::string cppOpcodes, cOpcodes;
+    for (auto const &[value, name]: opcodes) {
+      std::ostringstream hex;
+      hex << "0x" << std::hex << value;
+      cppOpcodes += "    " + qualifier + " size_t " + name + " = " + hex.str() + ";\n";
+      cOpcodes += "#define MUGEN_OPCODE_" + name + " " + hex.str() + "\n";
+    }
+
+    // The first label is the most significant flag bit
+    std::string cppFlags, cFlags;
+    auto const &labels = result.address.flag_labels;
+    for (size_t idx = 0; idx != labels.size(); ++idx) {
+      std::ostringstream hex;
+      hex << "0x" << std::hex << (size_t{1} << (labels.size() - idx - 1));
+      cppFlags += "    " + qualifier + " size_t " + labels[idx] + " = " + hex.str() + ";\n";
+      cFlags += "#define MUGEN_FLAG_" + labels[idx] + " " + hex.str() + "\n";
+    }
+
+    headerText = (_style == Style::CONSTEXPR) ? constexprHeader : tableHeader;
+    replaceMarker(headerText, "@WORD_BITS", std::to_string(wordBits));
+    replaceMarker(headerText, "@N_ADDRESSES", std::to_string(words.size()));
+    replaceMarker(headerText, "@N_SIGNALS", std::to_string(result.signals.size()));
+    replaceMarker(headerText, "@SIGNAL_NAMES", signalNames);
+    replaceMarker(headerText, "@CPP_SIGNALS\n", cppSignals);
+    replaceMarker(headerText, "@CPP_OPCODES\n", cppOpcodes);
+    replaceMarker(headerText, "@CPP_FLAGS\n", cppFlags);
+    replaceMarker(headerText, "@C_SIGNALS", cSignals);
+    replaceMarker(headerText, "@C_OPCODES", cOpcodes);
+    replaceMarker(headerText, "@C_FLAGS", cFlags);
+    replaceMarker(headerText, "@ADDRESS", addressExpression(result.address));
+    if (_style == Style::CONSTEXPR) replaceMarker(headerText, "@ARRAYS", oss.str());
+    else sourceText = tableSource;
+    summary << "\nControl word table: " << words.size() << " words of " << wordBits << " bits.";
+  }
+  else if (_style == Style::RLE) {
+    std::ostringstream offsets;
+    std::vector<unsigned char> compressed;
+    for (size_t idx = 0; idx != nImages; ++idx) {
+      offsets << (idx ? ", " : "") << compressed.size();
+      compress(result.images[idx], nBytes, compressed);
+    }
+    formatBytes(oss, compressed.data(), compressed.size());
+    oss << '\n';
 
-  replaceMarker(source, "@SPEC_FILE", specFilename);
-  replaceMarker(source, "@HEADER_FILE", std::filesystem::path(headerFilename).filename().string());
-  replaceMarker(source, "@ARRAYS", oss.str());
+    headerText = compressedHeader;
+    replaceMarker(headerText, "@IMAGE_SIZE", std::to_string(nBytes));
+    replaceMarker(headerText, "@N_IMAGES", std::to_string(nImages));
+    replaceMarker(headerText, "@COMPRESSED_SIZE", std::to_string(compressed.size()));
+    replaceMarker(headerText, "@OFFSETS", offsets.str());
+    sourceText = compressedSource;
+    summary << "\nCompressed " << nImages * nBytes << " bytes to " << compressed.size() << " bytes.";
+  }
+  else {
+    for (size_t idx = 0; idx != nImages; ++idx) {
+      oss << "    {\n";
+      formatBytes(oss, result.images[idx].data(), nBytes);
+      oss << "\n    },\n";
+    }
+
+    headerText = header;
+    replaceMarker(headerText, "@IMAGE_SIZE", std::to_string(nBytes));
+    replaceMarker(headerText, "@N_IMAGES", std::to_string(nImages));
+    sourceText = source;
+  }
+
+  replaceMarker(headerText, "@SPEC_FILE", specFilename);
+  replaceMarker(sourceText, "@SPEC_FILE", specFilename);
+  replaceMarker(sourceText, "@HEADER_FILE", std::filesystem::path(headerFilename).filename().string());
+  replaceMarker(sourceText, "@ARRAYS", oss.str());
 
-  // Write to files
-  std::ofstream sourceFile(_filename);
-  if (!sourceFile) {
-    std::cerr << "ERROR: could not open " << _filename << " for writing.\n";
-    return {false, ""};
+  // Write to files; the constexpr header does not need a source file
+  bool const headerOnly = (_style == Style::CONSTEXPR);
+  std::ofstream sourceFile;
+  if (!headerOnly) {
+    sourceFile.open(_filename);
+    if (!sourceFile) {
+      return {false, "could not open " + _filename + " for writing."};
+    }
   }
 
   std::ofstream headerFile(headerFilename);
   if (!headerFile) {
-    std::cerr << "ERROR: could not open " << headerFilename << " for writing.\n";
-    return {false, ""};
+    return {false, "could not open " + headerFilename + " for writing."};
   }
 
-  sourceFile << source;
-  headerFile << header;
+  sourceFile << sourceText;
+  headerFile << headerText;
 
   std::ostringstream report;
-  report << "Successfully created CPP source files: "
-	 <<  _filename << ", " << headerFilename << ".";
+  if (headerOnly) report << "Successfully created CPP header file: " << headerFilename << ".";
+  else report << "Successfully created CPP source files: "
+	      <<  _filename << ", " << headerFilename << ".";
+  report << summary.str();
   
-  return {true, report.str()};
+  return {true, report.str(), sourceText.size() + headerText.size()};
 }
 
@@ -0,0 +1,81 @@
+#include <fstream>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mugen.h"
+
+namespace {
+
+  // Compares n bytes, 16 at a time when SSE2 is available
+  bool equal(unsigned char const *a, unsigned char const *b, size_t n) {
+    size_t idx = 0;
+#ifdef __SSE2__
+    for (; idx + 64 <= n; idx += 64) {
+      __m128i diff = _mm_setzero_si128();
+      for (size_t offset = 0; offset != 64; offset += 16) {
+        __m128i const x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(a + idx + offset));
+        __m128i const y = _mm_loadu_si128(reinterpret_cast<__m128i const *>(b + idx + offset));
+        diff = _mm_or_si128(diff, _mm_xor_si128(x, y));
+      }
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff) return false;
+    }
+    for (; idx + 16 <= n; idx += 16) {
+      __m128i const x = _mm_loadu_si128(reinterpret_cast<__m128i const *>(a + idx));
+      __m128i const y = _mm_loadu_si128(reinterpret_cast<__m128i const *>(b + idx));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff) return false;
+    }
+#endif
+    return std::memcmp(a + idx, b + idx, n - idx) == 0;
+  }
+
+  template <typename Int>
+  void put(std::ostream &out, Int value, size_t nBytes) {
+    for (size_t idx = 0; idx != nBytes; ++idx) out.put(static_cast<char>((value >> (8 * idx)) & 0xff));
+  }
+}
+
+Mugen::ImageDelta Mugen::compareImage(unsigned char const *previous, size_t previousSize, Image const &image, size_t pageSize) {
+  ImageDelta delta;
+  delta.pageSize = pageSize;
+  delta.pages = (image.size() + pageSize - 1) / pageSize;
+
+  if (previousSize != image.size()) {
+    delta.changedPages = delta.pages;
+    if (image.size() > 0) delta.ranges.push_back({0, image.size()});
+    return delta;
+  }
+
+  for (size_t begin = 0; begin < image.size(); begin += pageSize) {
+    size_t const end = std::min(begin + pageSize, image.size());
+    if (equal(previous + begin, image.data() + begin, end - begin)) continue;
+
+    ++delta.changedPages;
+    if (!delta.ranges.empty() && delta.ranges.back().second == begin) delta.ranges.back().second = end;
+    else delta.ranges.push_back({begin, end});
+  }
+  return delta;
+}
+
+size_t Mugen::writePatch(std::string const &filename, std::vector<Image> const &images, std::vector<ImageDelta> const &deltas) {
+  std::ofstream out(filename, std::ios::binary);
+  if (!out) return 0;
+
+  out.write("MUPATCH1", 8);
+  put(out, images.size(), 4);
+  put(out, deltas.empty() ? 0 : deltas[0].pageSize, 4);
+  for (size_t idx = 0; idx != images.size(); ++idx) {
+    put(out, images[idx].size(), 8);
+    put(out, deltas[idx].ranges.size(), 4);
+    for (auto const &[begin, end]: deltas[idx].ranges) {
+      put(out, begin, 8);
+      put(out, end - begin, 8);
+      out.write(reinterpret_cast<char const *>(images[idx].data() + begin), end - begin);
+    }
+  }
+
+  size_t const size = out.tellp();
+  out.close();
+  return out ? size : 0;
+}
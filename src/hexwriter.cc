@@ -0,0 +1,189 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+#include <array>
+
+#include "mugen.h"
+
+namespace {
+
+  // The two hex digits of every byte value, so that records are formatted without iostreams
+  constexpr auto s_hexDigits = [] {
+    std::array<std::array<char, 2>, 256> table{};
+    char const digits[] = "0123456789ABCDEF";
+    for (size_t byte = 0; byte != 256; ++byte)
+      table[byte] = {digits[byte >> 4], digits[byte & 0xf]};
+    return table;
+  }();
+
+  // Appends bytes as hex digits, keeping the sum of the bytes for the checksum of the record
+  struct HexEncoder {
+    std::string &out;
+    unsigned sum = 0;
+
+    void byte(unsigned char value) {
+      out.append(s_hexDigits[value].data(), 2);
+      sum += value;
+    }
+
+    void bytes(unsigned char const *data, size_t n) {
+      for (size_t idx = 0; idx != n; ++idx) byte(data[idx]);
+    }
+
+    // Appends the nBytes least significant bytes of value, most significant first
+    void number(size_t value, size_t nBytes) {
+      while (nBytes--) byte((value >> (8 * nBytes)) & 0xff);
+    }
+  };
+
+  constexpr size_t s_recordSize = 16;
+  constexpr size_t s_flushSize = size_t{1} << 20;
+}
+
+std::string Mugen::RecordWriter::filename(size_t idx, size_t count) const {
+  return _filename + ((count > 1) ? ("." + std::to_string(idx)) : "");
+}
+
+Mugen::WriteResult Mugen::RecordWriter::write(Result const &result) {
+  std::ostringstream report;
+  report << "Successfully generated " << result.images.size() << " " << format()
+         << " file(s) from " << result.specificationFilename << ": \n\n";
+
+  size_t bytes = 0;
+  for (size_t idx = 0; idx != result.images.size(); ++idx) {
+    std::string const file = filename(idx, result.images.size());
+    std::ofstream out(file, std::ios::binary);
+    if (!out) {
+      return {false, "could not open output file \"" + file + "\"."};
+    }
+
+    // The records are collected in a buffer, which is written whenever it has grown large enough
+    Image const &image = result.images[idx];
+    std::string buffer;
+    buffer.reserve(s_flushSize + 64);
+    header(buffer, std::filesystem::path(file).filename().string(), image.size());
+
+    auto const *ranges = (idx < _deltas.size()) ? &_deltas[idx].ranges : nullptr;
+    size_t range = 0;
+
+    size_t records = 0;
+    size_t skipped = 0;
+    size_t unchanged = 0;
+    for (size_t address = 0; address < image.size(); address += s_recordSize) {
+      size_t const n = std::min(s_recordSize, image.size() - address);
+      unsigned char const *data = image.data() + address;
+      if (ranges) {
+        while (range != ranges->size() && (*ranges)[range].second <= address) ++range;
+        if (range == ranges->size() || (*ranges)[range].first >= address + n) {
+          ++unchanged;
+          continue;
+        }
+      }
+      if (_skip && std::all_of(data, data + n, [&](unsigned char byte) { return byte == *_skip; })) {
+        ++skipped;
+        continue;
+      }
+
+      record(buffer, address, data, n);
+      ++records;
+      if (buffer.size() >= s_flushSize) {
+        out.write(buffer.data(), buffer.size());
+        bytes += buffer.size();
+        buffer.clear();
+      }
+    }
+
+    footer(buffer, records, image.size());
+    out.write(buffer.data(), buffer.size());
+    bytes += buffer.size();
+
+    report << "  " << "ROM " << idx << ": " << file << " (" << records << " records";
+    if (_skip) report << ", " << skipped << " skipped";
+    if (ranges) report << ", " << unchanged << " unchanged";
+    report << ")\n";
+  }
+
+  return {true, report.str(), bytes};
+}
+
+// Intel HEX: ':', byte count, 16-bit address, record type, data and the two's complement of the
+// sum of all bytes. Addresses beyond 64 KiB are reached through extended linear address records.
+void Mugen::IntelHexWriter::header(std::string &, std::string const &, size_t) {
+  _segment = 0;
+}
+
+void Mugen::IntelHexWriter::record(std::string &out, size_t address, unsigned char const *data, size_t n) {
+  size_t const segment = address >> 16;
+  if (segment != _segment) {
+    HexEncoder hex{out += ':'};
+    hex.number(0x02000004, 4);
+    hex.number(segment, 2);
+    hex.byte(-hex.sum & 0xff);
+    out += '\n';
+    _segment = segment;
+  }
+
+  HexEncoder hex{out += ':'};
+  hex.byte(n);
+  hex.number(address & 0xffff, 2);
+  hex.byte(0x00);
+  hex.bytes(data, n);
+  hex.byte(-hex.sum & 0xff);
+  out += '\n';
+}
+
+void Mugen::IntelHexWriter::footer(std::string &out, size_t, size_t) {
+  out += ":00000001FF\n";
+}
+
+// Motorola S-record: 'S', record type, byte count (of the address, data and checksum), address,
+// data and the ones' complement of the sum of all bytes. The header (S0) contains the file name,
+// the data is followed by the record count (S5/S6) and the termination record (S9/S8/S7).
+void Mugen::SRecordWriter::header(std::string &out, std::string const &name, size_t size) {
+  _addressBytes = (size <= 0x10000) ? 2 : (size <= 0x1000000) ? 3 : 4;
+
+  std::string const text = name.substr(0, 64);
+  HexEncoder hex{out += "S0"};
+  hex.byte(2 + text.size() + 1);
+  hex.number(0, 2);
+  hex.bytes(reinterpret_cast<unsigned char const *>(text.data()), text.size());
+  hex.byte(~hex.sum & 0xff);
+  out += '\n';
+}
+
+void Mugen::SRecordWriter::record(std::string &out, size_t address, unsigned char const *data, size_t n) {
+  out += 'S';
+  out += static_cast<char>('0' + _addressBytes - 1);
+  HexEncoder hex{out};
+  hex.byte(_addressBytes + n + 1);
+  hex.number(address, _addressBytes);
+  hex.bytes(data, n);
+  hex.byte(~hex.sum & 0xff);
+  out += '\n';
+}
+
+void Mugen::SRecordWriter::footer(std::string &out, size_t records, size_t) {
+  if (records <= 0xffff) {
+    HexEncoder hex{out += "S5"};
+    hex.byte(3);
+    hex.number(records, 2);
+    hex.byte(~hex.sum & 0xff);
+    out += '\n';
+  }
+  else if (records <= 0xffffff) {
+    HexEncoder hex{out += "S6"};
+    hex.byte(4);
+    hex.number(records, 3);
+    hex.byte(~hex.sum & 0xff);
+    out += '\n';
+  }
+
+  HexEncoder hex{out += 'S'};
+  out += static_cast<char>('0' + 11 - _addressBytes);
+  hex.byte(_addressBytes + 1);
+  hex.number(0, _addressBytes);
+  hex.byte(~hex.sum & 0xff);
+  out += '\n';
+}
@@ -1,13 +1,33 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <chrono>
+#include <atomic>
+#include <numeric>
+#include <iomanip>
+#include <cstdlib>
+#include <new>
+#include <optional>
+#include <system_error>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
 #include "mugen.h"
 #include "util.h"
+#include "parallel.h"
 
 int printHelp(std::string const &progName, int ret = 0) {
-  std::cout << "Usage: " << progName << " <specification-file (.mu)> <output-file> [OPTIONS]\n\n"
+  std::cout << "Usage: " << progName << " <specification-file (.mu)> <output-file> [OPTIONS]\n"
+            << "       " << progName << " <specification-file (.mu)> --check [OPTIONS]\n"
+            << "       " << progName << " --batch <manifest-file> [OPTIONS]\n\n"
 	    << "Supported output-file extensions:\n"
 	    << "  .bin, .rom           -> Generate binary file(s).\n"
 	    << "  .c, .cpp, .cc, .cxx  -> Generate C/C++ source files\n"
+	    << "  .hex, .ihex, .ihx    -> Generate Intel HEX file(s).\n"
+	    << "  .srec, .s19, .s28, .s37, .mot -> Generate Motorola S-record file(s).\n"
 	    << "\n"
             << "Options:\n"
             << "  -h, --help       Display this help message and exit\n"
@@ -15,7 +35,34 @@ int printHelp(std::string const &progName, int ret = 0) {
             << "  -m, --msb-first  Store signals starting from the most significant bit.\n"
             << "  -p, --pad VALUE  Pad the remainder of the rom with the supplied value (may be hex).\n"
             << "  -p, --pad catch  Pad the remainder of the rom with the signals specified in the catch-rule.\n"
+            << "  -k, --skip VALUE Leave out the records of Intel HEX or S-record files whose bytes all equal\n"
+            << "                   VALUE (hex), e.g. the erased state of the chips or the value passed to --pad.\n"
+            << "  --delta PREVIOUS Compare the images with those written before to PREVIOUS (e.g. microcode.bin)\n"
+            << "                   and write the changed pages to <output-file>.patch. Intel HEX and S-record\n"
+            << "                   output only contains the changed pages.\n"
+            << "  --page-size N    Page size used by --delta, in bytes (default 64).\n"
+            << "  --cpp-format F   Format of C/C++ output: \"arrays\" (default), \"rle\", which stores the images\n"
+            << "                   run-length encoded together with a streaming decompressor, or \"table\",\n"
+            << "                   a table of control words indexed by the logical address. \"constexpr\"\n"
+            << "                   writes this table to a C++20 header only, for use at compile time.\n"
             << "  -d, --debug      Run Mugen in an interactive debug mode. Type \"help\" for more information.\n"
+            << "  -n, --check      Only check the specification for errors; no output is generated.\n"
+            << "  -j, --jobs N     Expand the microcode rules using up to N threads (1-1024).\n"
+            << "                   In batch mode: build N specifications at the same time.\n"
+            << "  -w, --watch      Regenerate the output every time the specification is saved.\n"
+            << "  -c, --chunk N    Generate the images 2^N addresses at a time, writing every finished\n"
+            << "                   part while the next is generated. Limits the memory used for large roms.\n"
+            << "                   Only for binary output (.bin, .rom).\n"
+            << "  -s, --stats      Report the time spent in each phase, the peak memory usage and counts\n"
+            << "                   of the rules, addresses, bytes written and allocations.\n"
+            << "  --stats-json     Like --stats, formatted as JSON.\n"
+            << "  --profile-rules  Report the addresses and time spent per microcode rule, most expensive first.\n"
+            << "  --trace FILE     Write the phases and the expansion of every rule to FILE as a Chrome trace\n"
+            << "                   (see chrome://tracing or https://ui.perfetto.dev).\n"
+            << "\nBatch mode:\n"
+            << "  Each line of the manifest file contains a specification file, an output file and\n"
+            << "  optionally additional options for this pair. Paths are relative to the manifest.\n"
+            << "  Options passed on the command line apply to every line of the manifest.\n"
             << "\nExample:\n"
             << "  " << progName << " myspec.mu microcode.bin --pad catch --msb-first --layout\n"
             << "See https://github.com/jorenheit/mugen for more help.\n";
@@ -23,78 +70,748 @@ int printHelp(std::string const &progName, int ret = 0) {
   return ret;
 }
 
-int main(int argc, char **argv) {
-  
-  if (argc == 2 && (std::string(argv[1]) == "-h" || std::string(argv[1]) == "--help")) {
-    return printHelp(argv[0]);
-  }
-  if (argc < 3) {
-    std::cerr << "ERROR: Invalid number of arguments.\n\n";
-    return printHelp(argv[0], 1);
-  }
+struct Settings {
+  enum class Stats {
+    NONE,
+    TEXT,
+    JSON
+  };
   
-  bool debugMode = false;
   Mugen::Options opt;
+  Stats stats = Stats::NONE;
+  std::string traceFile;
+  std::optional<unsigned char> skipValue;
+  std::optional<Mugen::CPPWriter::Style> cppStyle;
+  std::string deltaFrom;
+  size_t pageSize = 64;
+  bool debugMode = false;
+  bool check = false;
+  bool jobsSpecified = false;
+  bool watch = false;
+  bool help = false;
+};
+
+// Parses the options in args into settings. Returns an error message when an option is invalid,
+// or an empty string on success.
+std::string parseOptions(std::vector<std::string> const &args, Settings &settings) {
+  auto &opt = settings.opt;
   
-  for (int idx = 3; idx != argc; ++idx) {
-    std::string flag = argv[idx];
+  for (size_t idx = 0; idx != args.size(); ++idx) {
+    std::string const &flag = args[idx];
     if (flag == "-l" || flag == "--layout") opt.printLayout = true;
     else if (flag == "-m" || flag == "--msb-first") opt.lsbFirst = false;
     else if (flag == "-p" || flag == "--pad") {
-      if (idx == argc - 1) {
-        std::cerr << "ERROR: no argument to --pad (-p) option.\n\n";
-        return printHelp(argv[0], 1);
+      if (idx == args.size() - 1) {
+        return "no argument to --pad (-p) option.";
       }
       int value = 0;
       idx += 1;
-      if (argv[idx] == std::string("catch")) {
+      if (args[idx] == "catch") {
         opt.padImages = Mugen::Options::Padding::CATCH;
         continue;
       }
-      if (!stringToInt(argv[idx], value, 16)) {
-        std::cerr << "ERROR: argument passed to --pad (-p) must be a hex value or \"catch\".\n\n";
-        return printHelp(argv[0], 1);
+      if (!stringToInt(args[idx], value, 16)) {
+        return "argument passed to --pad (-p) must be a hex value or \"catch\".";
       }
-      if (value > 0xff) {
-        std::cerr << "ERROR: hex value passed to --pad (-p) exceeds 8 bits.\n\n";
-        return printHelp(argv[0], 1);
+      if (value < 0 || value > 0xff) {
+        return "hex value passed to --pad (-p) exceeds 8 bits.";
       }
       
       opt.padImages = Mugen::Options::Padding::VALUE;
       opt.padValue = value;
     }
-    else if (flag == "-d" || flag == "--debug") debugMode = true;
-    else if (flag == "-h" || flag == "--help") return printHelp(argv[0], 0);
+    else if (flag == "-k" || flag == "--skip") {
+      if (idx == args.size() - 1) {
+        return "no argument to --skip (-k) option.";
+      }
+      int value = 0;
+      idx += 1;
+      if (!stringToInt(args[idx], value, 16) || value < 0 || value > 0xff) {
+        return "argument passed to --skip (-k) must be an 8-bit hex value.";
+      }
+      settings.skipValue = value;
+    }
+    else if (flag == "--delta") {
+      if (idx == args.size() - 1) {
+        return "no argument to --delta option.";
+      }
+      idx += 1;
+      settings.deltaFrom = args[idx];
+    }
+    else if (flag == "--page-size") {
+      if (idx == args.size() - 1) {
+        return "no argument to --page-size option.";
+      }
+      idx += 1;
+      if (!stringToInt(args[idx], settings.pageSize) || settings.pageSize == 0) {
+        return "argument passed to --page-size must be a positive number.";
+      }
+    }
+    else if (flag == "--cpp-format") {
+      if (idx == args.size() - 1) {
+        return "no argument to --cpp-format option.";
+      }
+      idx += 1;
+      if (args[idx] == "arrays") settings.cppStyle = Mugen::CPPWriter::Style::ARRAYS;
+      else if (args[idx] == "rle") settings.cppStyle = Mugen::CPPWriter::Style::RLE;
+      else if (args[idx] == "table") settings.cppStyle = Mugen::CPPWriter::Style::TABLE;
+      else if (args[idx] == "constexpr") settings.cppStyle = Mugen::CPPWriter::Style::CONSTEXPR;
+      else return "argument passed to --cpp-format must be \"arrays\", \"rle\", \"table\" or \"constexpr\".";
+    }
+    else if (flag == "-d" || flag == "--debug") settings.debugMode = true;
+    else if (flag == "-n" || flag == "--check") settings.check = true;
+    else if (flag == "-j" || flag == "--jobs") {
+      if (idx == args.size() - 1) {
+        return "no argument to --jobs (-j) option.";
+      }
+      idx += 1;
+      long long jobs = 0;
+      if (!stringToInt(args[idx], jobs) || jobs < 1 || jobs > static_cast<long long>(Mugen::Options::MaxJobs)) {
+        return "argument passed to --jobs (-j) must be a number from 1 to " + std::to_string(Mugen::Options::MaxJobs) + ".";
+      }
+      opt.jobs = jobs;
+      settings.jobsSpecified = true;
+    }
+    else if (flag == "-w" || flag == "--watch") settings.watch = true;
+    else if (flag == "-c" || flag == "--chunk") {
+      if (idx == args.size() - 1) {
+        return "no argument to --chunk (-c) option.";
+      }
+      idx += 1;
+      if (!stringToInt(args[idx], opt.chunkBits) || opt.chunkBits == 0 || opt.chunkBits >= 64) {
+        return "argument passed to --chunk (-c) must be a number of address bits (1-63).";
+      }
+    }
+    else if (flag == "-s" || flag == "--stats") settings.stats = Settings::Stats::TEXT;
+    else if (flag == "--stats-json") settings.stats = Settings::Stats::JSON;
+    else if (flag == "--profile-rules") opt.profileRules = true;
+    else if (flag == "--trace") {
+      if (idx == args.size() - 1) {
+        return "no argument to --trace option.";
+      }
+      idx += 1;
+      settings.traceFile = args[idx];
+    }
+    else if (flag == "-h" || flag == "--help") settings.help = true;
     else {
-      std::cerr << "ERROR: Unknown option \"" << flag << "\".\n\n";
-      return printHelp(argv[0], 1);
+      return "Unknown option \"" + flag + "\".";
     }
   }
   
-  std::string inFilename = argv[1];
-  std::string outFilename = argv[2];
+  return "";
+}
+
+// Every allocation made by the program is counted, for --stats
+static std::atomic<size_t> s_allocations{0};
+static std::atomic<size_t> s_allocatedBytes{0};
+
+void *operator new(size_t size) {
+  s_allocations.fetch_add(1, std::memory_order_relaxed);
+  s_allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+  if (void *ptr = std::malloc(size ? size : 1)) return ptr;
+  throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  s_allocations.fetch_add(1, std::memory_order_relaxed);
+  s_allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+  size_t const align = static_cast<size_t>(alignment);
+  if (void *ptr = std::aligned_alloc(align, (size + align - 1) / align * align)) return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept { std::free(ptr); }
+
+double elapsed(Mugen::Clock::time_point begin, Mugen::Clock::time_point end) {
+  return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
+// Measurements of a single build, reported by --stats. Phases are listed in the order in which
+// they first ended; nested phases (e.g. expandRules within expandChunked) are included in both.
+// For --trace, every occurrence of a phase is kept as well.
+struct Statistics {
+  struct Span {
+    std::string phase;
+    Mugen::Clock::time_point begin;
+    Mugen::Clock::time_point end;
+  };
+  
+  std::vector<std::pair<std::string, double>> phases;
+  std::vector<Span> spans;
+  Mugen::Clock::time_point start;
+  double generateTime = 0;
+  double writeTime = 0;
+  std::string writer;
+  size_t rules = 0;
+  size_t addresses = 0;
+  size_t written = 0;
+  size_t caught = 0;
+  size_t bytes = 0;
+  size_t allocations = 0;
+  size_t allocatedBytes = 0;
+  size_t peakMemory = 0;
   
-  auto result = Mugen::generate(inFilename, opt);
-  bool writeResult = true;
-  if (debugMode) {
-    writeResult = Mugen::debug(result, outFilename);
+  void addPhase(std::string const &name, Mugen::Clock::time_point begin, Mugen::Clock::time_point end) {
+    spans.push_back({name, begin, end});
+    double const ms = elapsed(begin, end);
+    auto it = std::find_if(phases.begin(), phases.end(), [&](auto const &phase) { return phase.first == name; });
+    if (it == phases.end()) phases.emplace_back(name, ms);
+    else it->second += ms;
   }
   
-  if (writeResult) {
-    auto writer = Mugen::Writer::get(outFilename);
-    if (!writer) {
-      std::cerr << "ERROR: unsupported file extension.\n\n";
-      return printHelp(argv[0], 1);
+  // Rules do not overlap, so every rule except the catch rule writes 2^(number of wildcard bits)
+  // logical addresses; the catch rule fills the remaining ones.
+  void countAddresses(Mugen::Result const &result) {
+    size_t const logicalBits = result.address.total_address_bits - result.address.segment_bits;
+    rules = result.rules.size();
+    addresses = size_t{1} << logicalBits;
+    written = 0;
+    for (size_t idx = 0; idx != rules; ++idx) {
+      if (result.rules.catchAll[idx]) continue;
+      written += size_t{1} << (logicalBits - std::popcount(result.rules.mask[idx]));
+    }
+    caught = result.rules.hasCatch() ? addresses - written : 0;
+  }
+};
+
+// Peak resident set size of the process in bytes, or 0 when unknown
+size_t peakMemory() {
+#ifdef __linux__
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+  return 0;
+}
+
+std::string statsReport(Statistics const &stats, bool json) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(3);
+  
+  if (json) {
+    out << "{\"phases_ms\": {";
+    for (size_t idx = 0; idx != stats.phases.size(); ++idx)
+      out << (idx ? ", " : "") << '"' << stats.phases[idx].first << "\": " << stats.phases[idx].second;
+    out << "}, \"generate_ms\": " << stats.generateTime
+        << ", \"write_ms\": " << stats.writeTime
+        << ", \"writer\": \"" << stats.writer << '"'
+        << ", \"peak_memory_bytes\": " << stats.peakMemory
+        << ", \"rules\": " << stats.rules
+        << ", \"addresses\": " << stats.addresses
+        << ", \"addresses_written\": " << stats.written
+        << ", \"addresses_catch\": " << stats.caught
+        << ", \"bytes_written\": " << stats.bytes
+        << ", \"allocations\": " << stats.allocations
+        << ", \"allocated_bytes\": " << stats.allocatedBytes
+        << "}\n";
+    return out.str();
+  }
+  
+  auto line = [&](std::string const &label) -> std::ostream & {
+    return out << "  " << std::left << std::setw(28) << label << std::right;
+  };
+  
+  out << "Statistics:\n";
+  for (auto const &[phase, ms]: stats.phases) line(phase) << std::setw(12) << ms << " ms\n";
+  line("generate (total)") << std::setw(12) << stats.generateTime << " ms\n";
+  if (!stats.writer.empty()) line("write (" + stats.writer + ")") << std::setw(12) << stats.writeTime << " ms\n";
+  out << '\n';
+  line("peak memory") << std::setw(12) << stats.peakMemory / 1024 << " KiB\n";
+  line("rules") << std::setw(12) << stats.rules << '\n';
+  line("addresses") << std::setw(12) << stats.addresses << '\n';
+  line("addresses written by rules") << std::setw(12) << stats.written << '\n';
+  line("addresses filled by catch") << std::setw(12) << stats.caught << '\n';
+  line("bytes written") << std::setw(12) << stats.bytes << '\n';
+  line("allocations") << std::setw(12) << stats.allocations
+                      << " (" << stats.allocatedBytes / 1024 << " KiB)\n";
+  return out.str();
+}
+
+std::string profileReport(Mugen::Result const &result) {
+  std::vector<size_t> order(result.profile.size());
+  std::iota(order.begin(), order.end(), 0);
+  auto cost = [&](size_t idx) {
+    return result.profile[idx].compileTime + result.profile[idx].expandTime;
+  };
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return cost(a) > cost(b); });
+  
+  auto us = [](Mugen::Clock::duration time) {
+    return std::chrono::duration<double, std::micro>(time).count();
+  };
+  
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(3);
+  out << "Rule profile (most expensive first):\n"
+      << "    line  wildcards      matched      written  macros  compile (us)   expand (us)\n";
+  for (size_t idx: order) {
+    Mugen::RuleProfile const &rule = result.profile[idx];
+    out << std::setw(8) << rule.lineNr
+        << std::setw(11) << rule.wildcardBits
+        << std::setw(13) << rule.matched
+        << std::setw(13) << rule.written
+        << std::setw(8) << rule.macroDepth
+        << std::setw(14) << us(rule.compileTime)
+        << std::setw(14) << us(rule.expandTime) << '\n';
+  }
+  return out.str();
+}
+
+// Writes the phases and the expansion of the rules in the Chrome trace event format. Phases are
+// shown on the calling thread, rules on the worker that expanded them.
+bool writeTrace(std::string const &filename, Statistics const &stats, Mugen::Result const &result) {
+  std::ofstream file(filename);
+  if (!file) {
+    std::cerr << "ERROR: could not open trace file \"" << filename << "\".\n";
+    return false;
+  }
+  
+  auto us = [&](Mugen::Clock::time_point time) {
+    return std::chrono::duration<double, std::micro>(time - stats.start).count();
+  };
+  
+  file << std::fixed << std::setprecision(3);
+  file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  file << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"main\"}}";
+  for (auto const &span: stats.spans) {
+    file << ",\n  {\"name\": \"" << span.phase << "\", \"cat\": \"phase\", \"ph\": \"X\", \"pid\": 1, \"tid\": 0"
+         << ", \"ts\": " << us(span.begin) << ", \"dur\": " << us(span.end) - us(span.begin) << "}";
+  }
+  
+  for (Mugen::RuleProfile const &rule: result.profile) {
+    if (rule.expandBegin == Mugen::Clock::time_point{}) continue;
+    file << ",\n  {\"name\": \"line " << rule.lineNr << "\", \"cat\": \"rule\", \"ph\": \"X\", \"pid\": 1"
+         << ", \"tid\": " << rule.thread
+         << ", \"ts\": " << us(rule.expandBegin)
+         << ", \"dur\": " << std::chrono::duration<double, std::micro>(rule.expandTime).count()
+         << ", \"args\": {\"line\": " << rule.lineNr
+         << ", \"wildcard_bits\": " << rule.wildcardBits
+         << ", \"matched\": " << rule.matched
+         << ", \"written\": " << rule.written
+         << ", \"macro_depth\": " << rule.macroDepth
+         << ", \"compile_us\": " << std::chrono::duration<double, std::micro>(rule.compileTime).count()
+         << "}}";
+  }
+  file << "\n]}\n";
+  return true;
+}
+
+// Applies the options that only concern some of the writers. Returns an error message when an
+// option does not apply to the writer, or an empty string on success.
+std::string configureWriter(Mugen::Writer &writer, Settings const &settings) {
+  if (settings.skipValue) {
+    auto *records = dynamic_cast<Mugen::RecordWriter *>(&writer);
+    if (!records) return "--skip (-k) can only be used with Intel HEX or S-record output.";
+    records->setSkipValue(*settings.skipValue);
+  }
+  if (settings.cppStyle) {
+    auto *cpp = dynamic_cast<Mugen::CPPWriter *>(&writer);
+    if (!cpp) return "--cpp-format can only be used with C/C++ output.";
+    cpp->setStyle(*settings.cppStyle);
+  }
+  if (settings.opt.chunkBits > 0 && !dynamic_cast<Mugen::BinaryFileWriter *>(&writer)) {
+    // Only the binary writer maps its images onto the output files; other formats would still
+    // hold the complete images in memory.
+    return "--chunk (-c) can only be used with binary output (.bin, .rom).";
+  }
+  return "";
+}
+
+// Reads the images that BinaryFileWriter wrote to prefix: prefix.0, prefix.1, ... or prefix itself
+// when there was a single image
+std::vector<std::vector<unsigned char>> readImages(std::string const &prefix) {
+  std::vector<std::vector<unsigned char>> images;
+  auto read = [&](std::string const &filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) return false;
+    images.emplace_back(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>{});
+    return true;
+  };
+  
+  for (size_t idx = 0; read(prefix + "." + std::to_string(idx)); ++idx) {}
+  if (images.empty()) read(prefix);
+  return images;
+}
+
+std::string deltaReport(std::string const &previous, std::vector<Mugen::ImageDelta> const &deltas) {
+  std::ostringstream out;
+  out << "Changes since " << previous << " (pages of " << (deltas.empty() ? 0 : deltas[0].pageSize) << " bytes):\n";
+  out << std::hex << std::setfill('0');
+  for (size_t idx = 0; idx != deltas.size(); ++idx) {
+    auto const &delta = deltas[idx];
+    out << "  ROM " << std::dec << idx << ": ";
+    if (delta.unchanged()) {
+      out << "unchanged, can be skipped.\n";
+      continue;
     }
     
-    auto [success, report] = writer->write(result);
-    if (!success) return 1;
-    std::cout << report << '\n';
+    out << delta.changedPages << " of " << delta.pages << " pages changed (" << std::hex;
+    size_t const shown = std::min<size_t>(delta.ranges.size(), 8);
+    for (size_t r = 0; r != shown; ++r) {
+      out << (r ? ", " : "") << "0x" << std::setw(4) << delta.ranges[r].first
+          << "-0x" << std::setw(4) << delta.ranges[r].second - 1;
+    }
+    out << (shown < delta.ranges.size() ? ", ...)\n" : ")\n");
+  }
+  return out.str();
+}
 
+// Generates the images for a single specification and writes them to the output file.
+// Everything that is reported is written to 'out'.
+bool build(std::string const &inFilename, std::string const &outFilename, Settings const &settings, std::ostream &out) {
+  auto writer = Mugen::Writer::get(outFilename);
+  if (!writer && !settings.check) {
+    out << "ERROR: unsupported file extension of output file \"" << outFilename << "\".\n";
+    return false;
+  }
+  if (writer) {
+    std::string const msg = configureWriter(*writer, settings);
+    if (!msg.empty()) {
+      out << "ERROR: " << msg << '\n';
+      return false;
+    }
+  }
+  
+  // The images are only generated when they are written; the debugger and --check only need the
+  // rules. The writer provides the memory of the images.
+  auto opt = settings.opt;
+  auto generateImages = [&writer](Mugen::Options &opt) {
+    opt.generateImages = true;
+    opt.allocator = [&writer](size_t idx, size_t count, size_t size) {
+      return writer->allocate(idx, count, size);
+    };
+    opt.onChunk = [&writer](size_t begin, size_t end) {
+      writer->flush(begin, end);
+    };
+  };
+  
+  if (settings.debugMode || settings.check) opt.generateImages = false;
+  else generateImages(opt);
+  
+  // The previous images are read before anything is generated, since the output may overwrite them
+  std::vector<std::vector<unsigned char>> previous;
+  if (!settings.deltaFrom.empty()) {
+    previous = readImages(settings.deltaFrom);
+    if (previous.empty()) {
+      out << "ERROR: could not open previous images \"" << settings.deltaFrom << "\".\n";
+      return false;
+    }
+  }
+  
+  // With --stats or --trace, the last generation and write are measured
+  Statistics stats;
+  size_t allocations = 0;
+  size_t allocatedBytes = 0;
+  if (settings.stats != Settings::Stats::NONE || !settings.traceFile.empty()) {
+    opt.onPhase = [&stats](char const *phase, Mugen::Clock::time_point begin, Mugen::Clock::time_point end) {
+      stats.addPhase(phase, begin, end);
+    };
+  }
+  if (!settings.traceFile.empty()) opt.profileRules = true;
+  
+  auto generate = [&] {
+    stats = Statistics{};
+    allocations = s_allocations;
+    allocatedBytes = s_allocatedBytes;
+    stats.start = Mugen::Clock::now();
+    auto result = Mugen::generate(inFilename, opt);
+    stats.generateTime = elapsed(stats.start, Mugen::Clock::now());
+    return result;
+  };
+  
+  auto reportMeasurements = [&](Mugen::Result const &result) {
+    if (settings.opt.profileRules) out << '\n' << profileReport(result);
+    if (settings.stats != Settings::Stats::NONE) {
+      stats.countAddresses(result);
+      stats.allocations = s_allocations - allocations;
+      stats.allocatedBytes = s_allocatedBytes - allocatedBytes;
+      stats.peakMemory = peakMemory();
+      out << '\n' << statsReport(stats, settings.stats == Settings::Stats::JSON);
+    }
+    return settings.traceFile.empty() || writeTrace(settings.traceFile, stats, result);
+  };
+  
+  try {
+    auto result = generate();
+    if (settings.check) {
+      out << "No errors found in " << inFilename << ".\n";
+      if (opt.printLayout) out << '\n' << layoutReport(result);
+      return reportMeasurements(result);
+    }
+    
+    if (settings.debugMode) {
+      if (!Mugen::debug(result, outFilename)) return true;
+      
+      // The diagnostics have been reported already
+      generateImages(opt);
+      opt.onDiagnostic = [](Mugen::Diagnostic const &) {};
+      result = generate();
+    }
+    
+    std::vector<Mugen::ImageDelta> deltas;
+    if (!settings.deltaFrom.empty()) {
+      for (size_t idx = 0; idx != result.images.size(); ++idx) {
+        auto const &old = (idx < previous.size()) ? previous[idx] : std::vector<unsigned char>{};
+        deltas.push_back(Mugen::compareImage(old.data(), old.size(), result.images[idx], settings.pageSize));
+      }
+      if (auto *records = dynamic_cast<Mugen::RecordWriter *>(writer.get())) records->setDeltas(deltas);
+    }
+    
+    auto const begin = Mugen::Clock::now();
+    auto [success, report, bytes] = writer->write(result);
+    if (!success) {
+      out << "ERROR: " << report << '\n';
+      return false;
+    }
+    stats.writeTime = elapsed(begin, Mugen::Clock::now());
+    stats.writer = writer->format();
+    stats.bytes = bytes;
+    out << report << '\n';
+    
+    if (!settings.deltaFrom.empty()) {
+      std::string const patchFilename = outFilename + ".patch";
+      size_t const patchSize = Mugen::writePatch(patchFilename, result.images, deltas);
+      if (patchSize == 0) {
+        out << "ERROR: could not write patch file \"" << patchFilename << "\".\n";
+        return false;
+      }
+      out << '\n' << deltaReport(settings.deltaFrom, deltas)
+          << "Patch written to " << patchFilename << " (" << patchSize << " bytes).\n";
+    }
+    
     if (opt.printLayout) {
-      std::cout << '\n' << layoutReport(result);
+      out << '\n' << layoutReport(result);
     }
+    if (!reportMeasurements(result)) return false;
+  }
+  catch (Mugen::Error const &) {
+    return false;
   }
   
-  return 0;
+  return true;
+}
+
+// Builds every specification listed in the manifest on a pool of worker threads. The output of
+// each build is collected and reported in the order of the manifest.
+int runBatch(std::string const &manifestFilename, Settings const &defaults) {
+  std::ifstream manifest(manifestFilename);
+  if (!manifest) {
+    std::cerr << "ERROR: could not open manifest file \"" << manifestFilename << "\".\n";
+    return 1;
+  }
+  
+  struct Job {
+    int lineNr;
+    std::string text;     // the line of the manifest, shown when it could not be parsed
+    std::string spec;
+    std::string output;
+    Settings settings;
+    std::ostringstream log;
+    bool success = false;
+  };
+  
+  std::filesystem::path const base = std::filesystem::path(manifestFilename).parent_path();
+  std::vector<std::unique_ptr<Job>> jobs;
+  std::string line;
+  int lineNr = 0;
+  
+  while (std::getline(manifest, line)) {
+    ++lineNr;
+    line = line.substr(0, line.find('#'));
+    
+    std::istringstream iss(line);
+    std::vector<std::string> args;
+    for (std::string arg; iss >> arg; ) args.push_back(arg);
+    if (args.empty()) continue;
+    
+    auto job = std::make_unique<Job>();
+    job->lineNr = lineNr;
+    job->text = trim(line);
+    job->settings = defaults;
+    if (args.size() < 2) {
+      job->log << manifestFilename << ":" << lineNr << ": ERROR: expected a specification file and an output file.\n";
+    }
+    else {
+      job->spec = (base / args[0]).string();
+      job->output = (base / args[1]).string();
+      std::string const msg = parseOptions({args.begin() + 2, args.end()}, job->settings);
+      if (!msg.empty()) 
+        job->log << manifestFilename << ":" << lineNr << ": ERROR: " << msg << '\n';
+      else if (job->settings.debugMode || job->settings.help || job->settings.watch)
+        job->log << manifestFilename << ":" << lineNr << ": ERROR: --debug, --watch and --help can not be used in batch mode.\n";
+    }
+    jobs.push_back(std::move(job));
+  }
+  
+  size_t const nThreads = threadCount(defaults.jobsSpecified ? defaults.opt.jobs : jobs.size(), jobs.size());
+  try {
+    ThreadPool pool(nThreads);
+    for (auto &job: jobs) {
+      if (!job->log.str().empty()) continue;
+      pool.submit([&job = *job] {
+        job.settings.opt.jobs = 1;
+        job.settings.opt.diagnostics = &job.log;
+        job.success = build(job.spec, job.output, job.settings, job.log);
+      });
+    }
+    pool.wait();
+  }
+  catch (std::system_error const &e) {
+    std::cerr << "ERROR: could not start " << nThreads << " worker threads (" << e.what() << ").\n";
+    return 1;
+  }
+  
+  size_t failed = 0;
+  for (auto const &job: jobs) {
+    std::cout << "[" << manifestFilename << ":" << job->lineNr << "] ";
+    if (job->spec.empty()) std::cout << job->text;
+    else std::cout << job->spec << " -> " << job->output;
+    std::cout << (job->success ? "" : " (FAILED)") << '\n' << job->log.str() << '\n';
+    failed += !job->success;
+  }
+  
+  std::cout << "Built " << (jobs.size() - failed) << " of " << jobs.size() << " specification(s).\n";
+  return (failed > 0) ? 1 : 0;
+}
+
+// Regenerates the output every time the specification is saved, until the program is interrupted.
+// Only the rules affected by an edit are recomputed; when the specification contains an error,
+// the previous output is left untouched.
+int runWatch(std::string const &inFilename, std::string const &outFilename, Settings const &settings) {
+#ifndef __linux__
+  std::cerr << "ERROR: --watch (-w) is only supported on Linux.\n";
+  return 1;
+#else
+  auto opt = settings.opt;
+  auto writer = Mugen::Writer::get(outFilename);
+  std::string const msg = configureWriter(*writer, settings);
+  if (!msg.empty()) {
+    std::cerr << "ERROR: " << msg << '\n';
+    return 1;
+  }
+  opt.allocator = [&writer](size_t idx, size_t count, size_t size) {
+    return writer->allocate(idx, count, size);
+  };
+  Mugen::IncrementalGenerator generator(inFilename, opt);
+  
+  auto regenerate = [&] {
+    auto const start = std::chrono::steady_clock::now();
+    try {
+      auto const &result = generator.update();
+      auto [success, report, bytes] = writer->write(result);
+      if (!success) {
+        std::cout << "ERROR: " << report << "\nOutput not updated.\n";
+        return;
+      }
+      
+      std::chrono::duration<double, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+      std::cout << report << "\nRegenerated in " << elapsed.count() << " ms.\n";
+      if (opt.printLayout) {
+        std::cout << '\n' << layoutReport(result);
+      }
+    }
+    catch (Mugen::Error const &) {
+      std::cout << "Output not updated.\n";
+    }
+    std::cout.flush();
+  };
+  
+  // Editors often save by replacing the file, so the directory is watched instead of the file itself
+  std::filesystem::path const path(inFilename);
+  std::string const dir = path.has_parent_path() ? path.parent_path().string() : ".";
+  std::string const name = path.filename().string();
+  
+  int const fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    std::cerr << "ERROR: could not watch \"" << inFilename << "\" for changes.\n";
+    return 1;
+  }
+  
+  regenerate();
+  std::cout << "Watching \"" << inFilename << "\" for changes. Press Ctrl-C to stop.\n" << std::flush;
+  
+  alignas(inotify_event) char buffer[4096];
+  while (true) {
+    ssize_t const n = read(fd, buffer, sizeof(buffer));
+    if (n <= 0) break;
+    
+    bool modified = false;
+    for (char *ptr = buffer; ptr < buffer + n; ) {
+      auto const *event = reinterpret_cast<inotify_event const *>(ptr);
+      if (event->len > 0 && name == event->name) modified = true;
+      ptr += sizeof(inotify_event) + event->len;
+    }
+    if (modified) regenerate();
+  }
+  
+  close(fd);
+  return 1;
+#endif
+}
+
+int main(int argc, char **argv) {
+  
+  if (argc == 2 && (std::string(argv[1]) == "-h" || std::string(argv[1]) == "--help")) {
+    return printHelp(argv[0]);
+  }
+  if (argc < 3) {
+    std::cerr << "ERROR: Invalid number of arguments.\n\n";
+    return printHelp(argv[0], 1);
+  }
+  
+  // The output file may be left out when only checking the specification
+  bool const hasOutput = (argv[2][0] != '-');
+  Settings settings;
+  std::string const msg = parseOptions({argv + (hasOutput ? 3 : 2), argv + argc}, settings);
+  if (!msg.empty()) {
+    std::cerr << "ERROR: " << msg << "\n\n";
+    return printHelp(argv[0], 1);
+  }
+  if (settings.help) return printHelp(argv[0], 0);
+  
+  if (argv[1] == std::string("--batch")) {
+    if (settings.debugMode || settings.watch) {
+      std::cerr << "ERROR: --debug (-d) and --watch (-w) can not be used in batch mode.\n\n";
+      return printHelp(argv[0], 1);
+    }
+    return runBatch(argv[2], settings);
+  }
+  
+  std::string inFilename = argv[1];
+  std::string outFilename = hasOutput ? argv[2] : "";
+  if (settings.check) {
+    if (settings.debugMode || settings.watch || !settings.deltaFrom.empty()) {
+      std::cerr << "ERROR: --check (-n) can not be combined with --debug (-d), --watch (-w) or --delta.\n\n";
+      return printHelp(argv[0], 1);
+    }
+    return build(inFilename, outFilename, settings, std::cout) ? 0 : 1;
+  }
+  
+  if (!hasOutput) {
+    std::cerr << "ERROR: no output file specified.\n\n";
+    return printHelp(argv[0], 1);
+  }
+  if (!Mugen::Writer::get(outFilename)) {
+    std::cerr << "ERROR: unsupported file extension.\n\n";
+    return printHelp(argv[0], 1);
+  }
+  
+  if (settings.watch) {
+    if (settings.debugMode) {
+      std::cerr << "ERROR: --debug (-d) can not be combined with --watch (-w).\n\n";
+      return printHelp(argv[0], 1);
+    }
+    if (settings.opt.chunkBits > 0) {
+      std::cerr << "ERROR: --chunk (-c) can not be combined with --watch (-w).\n\n";
+      return printHelp(argv[0], 1);
+    }
+    if (!settings.deltaFrom.empty()) {
+      std::cerr << "ERROR: --delta can not be combined with --watch (-w).\n\n";
+      return printHelp(argv[0], 1);
+    }
+    return runWatch(inFilename, outFilename, settings);
+  }
+  
+  return build(inFilename, outFilename, settings, std::cout) ? 0 : 1;
 } 
@@ -2,9 +2,18 @@
 #define PARSER_H
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <cstdint>
 #include <unordered_map>
 #include <memory>
+#include <functional>
+#include <utility>
+#include <ostream>
+#include <stdexcept>
+#include <chrono>
+#include <optional>
+#include <tuple>
 
 namespace Mugen {
 
@@ -14,7 +23,7 @@ namespace Mugen {
     size_t bits_per_word;
     size_t address_bits;
   };
-    
+
   struct AddressMapping {
     size_t cycle_bits = 0;
     size_t cycle_bits_start = 0;
@@ -32,26 +41,211 @@ namespace Mugen {
     std::vector<std::string> flag_labels;
   };
 
-  using Opcodes = std::unordered_map<std::string, size_t>;
+  // Hash for maps with string keys, which can then be searched for a std::string_view as well
+  struct StringHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view str) const {
+      return std::hash<std::string_view>{}(str);
+    }
+  };
+  
+  template <typename Value>
+  using StringMap = std::unordered_map<std::string, Value, StringHash, std::equal_to<>>;
+  
+  using Opcodes = StringMap<size_t>;
   using Signals = std::vector<std::string>;
-  using Macros  = std::unordered_map<std::string, Signals>;
-  using Image = std::vector<unsigned char>;
+  using Macros  = StringMap<Signals>;
+
+  // Contents of a single rom chip. The memory is either allocated on the heap or provided by
+  // a writer (e.g. a memory-mapped output file), in which case it is returned through release.
+  class Image {
+  public:
+    using Release = std::function<void(unsigned char *, size_t)>;
+
+  private:
+    unsigned char *_data = nullptr;
+    size_t _size = 0;
+    Release _release;
+
+  public:
+    Image() = default;
+
+    // Newly allocated images are zero-filled
+    explicit Image(size_t size):
+      _data(new unsigned char[size]()),
+      _size(size),
+      _release([](unsigned char *data, size_t) { delete[] data; })
+    {}
+
+    Image(unsigned char *data, size_t size, Release release):
+      _data(data),
+      _size(size),
+      _release(std::move(release))
+    {}
+
+    Image(Image &&other) noexcept:
+      _data(std::exchange(other._data, nullptr)),
+      _size(std::exchange(other._size, 0)),
+      _release(std::move(other._release))
+    {}
+
+    Image &operator=(Image &&other) noexcept {
+      std::swap(_data, other._data);
+      std::swap(_size, other._size);
+      std::swap(_release, other._release);
+      return *this;
+    }
+
+    ~Image() {
+      if (_data) _release(_data, _size);
+    }
+
+    unsigned char *data() { return _data; }
+    unsigned char const *data() const { return _data; }
+    size_t size() const { return _size; }
+
+    unsigned char &operator[](size_t idx) { return _data[idx]; }
+    unsigned char operator[](size_t idx) const { return _data[idx]; }
+
+    unsigned char *begin() { return _data; }
+    unsigned char *end() { return _data + _size; }
+    unsigned char const *begin() const { return _data; }
+    unsigned char const *end() const { return _data + _size; }
+  };
+  
+  // Provides the memory for image idx (out of count) of the given size
+  using ImageAllocator = std::function<Image(size_t idx, size_t count, size_t size)>;
+
+  // Compiled microcode rules, stored as a structure of arrays. Rule i applies to every address
+  // for which (address & mask[i]) == value[i] and sets the signals whose bits are set in signals[i].
+  // Segment bits are never fixed by a rule. Rules do not overlap, except for the catch rule: when
+  // defined, it is the last rule, has mask 0 and applies to the addresses not covered by any other.
+  struct Rules {
+    std::vector<size_t> mask;
+    std::vector<size_t> value;
+    std::vector<uint64_t> signals;
+    std::vector<int> lineNr;
+    std::vector<bool> catchAll;
 
+    size_t size() const {
+      return mask.size();
+    }
+
+    bool hasCatch() const {
+      return !catchAll.empty() && catchAll.back();
+    }
+
+    // Index of the rule that applies to the given (core) address, or -1 if there is none
+    int find(size_t address) const {
+      for (size_t idx = 0; idx != mask.size(); ++idx) 
+        if ((address & mask[idx]) == value[idx]) return idx;
+      return -1;
+    }
+  };
+  
+  // Run-length index of the rules that wrote the images. Each span covers the logical addresses
+  // (addresses without their segment bits) from its start up to the start of the next span, or
+  // the end of the image. The rule is an index into Result::rules, or -1 for addresses that were
+  // not written by any rule. The index is left empty by chunked generation.
+  struct ProvenanceSpan {
+    size_t start;
+    int rule;
+  };
+  using Provenance = std::vector<ProvenanceSpan>;
+
+  // Decision tree over the address bits, which finds the rule that applies to an address without
+  // generating the images. Inner nodes test a single bit of the (core) address and continue at
+  // next[bit]; leaves hold the index of the rule, or -1 when no rule applies.
+  struct RuleTree {
+    struct Node {
+      int bit;           // -1 for leaves
+      int rule;
+      uint32_t next[2];
+    };
+    std::vector<Node> nodes;   // the root is nodes[0]
+
+    int find(size_t address) const {
+      if (nodes.empty()) return -1;
+      Node const *node = &nodes[0];
+      while (node->bit >= 0) node = &nodes[node->next[(address >> node->bit) & 1]];
+      return node->rule;
+    }
+  };
+
+  using Clock = std::chrono::steady_clock;
+  
+  // Cost of a single rule, collected when Options::profileRules is set. Addresses are logical
+  // addresses (without their segment bits); the catch rule matches all of them, but only writes
+  // those that are not written by any other rule. The catch rule is expanded in parts on all
+  // threads; its time is the time until the last part is done.
+  struct RuleProfile {
+    int lineNr = 0;
+    size_t wildcardBits = 0;
+    size_t matched = 0;
+    size_t written = 0;
+    size_t macroDepth = 0;              // deepest nesting of the macros used (0: no macros)
+    Clock::duration compileTime{};
+    Clock::duration expandTime{};       // summed over all windows in chunked generation
+    Clock::time_point expandBegin{};    // start of the (first) expansion
+    size_t thread = 0;                  // worker that expanded the rule, 0 being the calling thread
+  };
+  using RuleProfiles = std::vector<RuleProfile>;
+
+  // An error or warning about the specification; line is 0 when it does not refer to a line
+  struct Diagnostic {
+    enum class Severity {
+      WARNING,
+      ERROR
+    };
+
+    Severity severity;
+    std::string file;
+    int line;
+    std::string message;
+  };
+  
+  using DiagnosticHandler = std::function<void(Diagnostic const &)>;
+  
+  // Receives the ranges [begin, end) of the images that are complete during chunked generation
+  using ChunkHandler = std::function<void(size_t begin, size_t end)>;
+  
+  // Receives the duration of each phase of the generation (e.g. "parseSignals") when it ends.
+  // Phases that run more than once (e.g. "expandRules" in chunked generation) are reported each time.
+  using PhaseHandler = std::function<void(char const *phase, Clock::time_point begin, Clock::time_point end)>;
+  
   struct Options {
     enum class Padding {
       NONE,
       VALUE,
       CATCH
     };
+    
+    static constexpr size_t MaxJobs = 1024;
         
     bool printLayout = false;
     bool lsbFirst = true;
     Padding padImages = Padding::NONE;
     unsigned char padValue = 0;
+    size_t jobs = 1;                     // at most MaxJobs; limited to the number of hardware threads
+    size_t chunkBits = 0;                // generate 2^chunkBits addresses at a time (0: all at once); bounds
+                                         // memory only when the allocator releases flushed chunks
+    bool generateImages = true;          // when false, the rules are only compiled and validated
+    bool profileRules = false;           // collect the cost of every rule in Result::profile
+    std::ostream *diagnostics = nullptr; // errors and warnings, defaults to std::cerr
+    DiagnosticHandler onDiagnostic;      // receives errors and warnings instead of the stream when set
+    ImageAllocator allocator;            // memory of the images, defaults to the heap
+    ChunkHandler onChunk;                // called from a worker thread, one range at a time
+    PhaseHandler onPhase;                // called on the thread that calls generate()
   };
-    
+
+  // When the images are not generated at once (see Options::chunkBits and generateImages), the
+  // provenance is left empty and the rules are looked up through the tree instead.
   struct Result {
     std::vector<Image> images;
+    Rules rules;
+    Provenance provenance;
+    RuleTree tree;
+    RuleProfiles profile;     // indexed like rules, empty unless Options::profileRules is set
 
     Opcodes opcodes;
     AddressMapping address;
@@ -59,17 +253,69 @@ namespace Mugen {
     Macros macros;
     RomSpecs rom;
     bool lsbFirst;
+    Options::Padding padding;
 
     std::string specificationFilename;
   };
 
+  // Thrown by generate() when the specification contains an error. The error has already been
+  // reported to the diagnostics stream (or handler) when this is thrown.
+  struct Error: std::runtime_error {
+    using std::runtime_error::runtime_error;
+  };
+  
+  // Generation is reentrant: specifications can be generated on several threads at once, and
+  // from within a diagnostic handler.
   Result generate(std::string const &specFile, Options const &opt);
+  
+  // Generates the specification contained in source; name is only used in diagnostics
+  Result generateFromSource(std::string_view source, std::string const &name, Options const &opt);
+
+  // Regenerates a specification after it has been edited. Only the rules that were added, changed
+  // or removed since the previous update are (re)written to the images. When update() throws an
+  // Error, the result of the previous update is kept.
+  class IncrementalGenerator {
+    struct State;
+    std::unique_ptr<State> _state;
+
+  public:
+    IncrementalGenerator(std::string const &specFile, Options const &opt);
+    ~IncrementalGenerator();
+
+    Result const &update();
+    Result const &result() const;
+  };
+  
   std::string layoutReport(Result const &result);
+  int ruleAt(Result const &result, size_t address);
+  int ruleLineAt(Result const &result, size_t address);
+  uint64_t controlWordAt(Result const &result, size_t address);
+  size_t imageSize(Result const &result);
   bool debug(Result const &result, std::string const &outFile);
 
+  // Parts of an image that changed since a previous version of it, as ascending, merged ranges
+  // [begin, end) of whole pages. When the sizes differ, the entire image has changed.
+  struct ImageDelta {
+    size_t pageSize = 0;
+    size_t pages = 0;
+    size_t changedPages = 0;
+    std::vector<std::pair<size_t, size_t>> ranges;
+
+    bool unchanged() const { return ranges.empty(); }
+  };
+  
+  ImageDelta compareImage(unsigned char const *previous, size_t previousSize, Image const &image, size_t pageSize);
+  
+  // Writes the changed ranges of the images to a binary patch file, all numbers little endian:
+  // the magic "MUPATCH1", the number of images (u32) and the page size (u32), followed by, for
+  // every image, its size (u64), the number of ranges (u32) and the offset (u64), length (u64)
+  // and contents of each range. Returns the size of the patch, or 0 when it could not be written.
+  size_t writePatch(std::string const &filename, std::vector<Image> const &images, std::vector<ImageDelta> const &deltas);
+
   struct WriteResult {
     bool success = false;
-    std::string report;
+    std::string report;    // summary of the output, or the error message on failure
+    size_t bytes = 0;      // total size of the output files
   };
   
   class Writer {
@@ -79,16 +325,27 @@ namespace Mugen {
     Writer(std::string const &file):
       _filename(file)
     {}
-    
+
     static std::unique_ptr<Writer> get(std::string const &filename);
     virtual WriteResult write(Result const &result) = 0;
+    virtual Image allocate(size_t, size_t, size_t size) { return Image(size); }
+    virtual void flush(size_t, size_t) {}
     virtual std::vector<std::string> extensions() const = 0;
     virtual std::string format() const = 0;
   };
 
-  struct BinaryFileWriter: public Writer {
+  // Images allocated through this writer are mapped directly onto the output files, so that the
+  // generator writes them in place and write() only has to report them. During chunked generation,
+  // flush() writes the completed parts to disk and releases their memory.
+  class BinaryFileWriter: public Writer {
+    std::vector<unsigned char *> _mapped;
+    std::string filename(size_t idx, size_t count) const;
+
+  public:
     using Writer::Writer;
     virtual WriteResult write(Result const &result) override;
+    virtual Image allocate(size_t idx, size_t count, size_t size) override;
+    virtual void flush(size_t begin, size_t end) override;
     virtual std::vector<std::string> extensions() const override {
       return {".bin", ".rom"};
     }
@@ -97,8 +354,87 @@ namespace Mugen {
     }
   };
 
-  struct CPPWriter: public Writer {
+  // Writes the images as text records of at most 16 data bytes, one file per image (like
+  // BinaryFileWriter). When a skip value is set, records whose bytes all equal it (e.g. the erased
+  // state of the chips or the pad value) are left out, so that a programmer does not write them.
+  // Likewise, when deltas are set, records outside the changed pages are left out.
+  class RecordWriter: public Writer {
+    std::optional<unsigned char> _skip;
+    std::vector<ImageDelta> _deltas;
+    std::string filename(size_t idx, size_t count) const;
+
+  protected:
+    virtual void header(std::string &out, std::string const &name, size_t size) = 0;
+    virtual void record(std::string &out, size_t address, unsigned char const *data, size_t n) = 0;
+    virtual void footer(std::string &out, size_t records, size_t size) = 0;
+
+  public:
+    using Writer::Writer;
+    void setSkipValue(unsigned char value) { _skip = value; }
+
+    // Only the records within the changed ranges of each image are written
+    void setDeltas(std::vector<ImageDelta> deltas) { _deltas = std::move(deltas); }
+    virtual WriteResult write(Result const &result) override;
+  };
+  
+  class IntelHexWriter: public RecordWriter {
+    size_t _segment = 0;    // upper 16 bits of the address of the last record
+
+  protected:
+    virtual void header(std::string &out, std::string const &name, size_t size) override;
+    virtual void record(std::string &out, size_t address, unsigned char const *data, size_t n) override;
+    virtual void footer(std::string &out, size_t records, size_t size) override;
+
+  public:
+    using RecordWriter::RecordWriter;
+    virtual std::vector<std::string> extensions() const override {
+      return {".hex", ".ihex", ".ihx"};
+    }
+    virtual std::string format() const override {
+      return "Intel HEX";
+    }
+  };
+  
+  // Uses S1, S2 or S3 records depending on the size of the images
+  class SRecordWriter: public RecordWriter {
+    size_t _addressBytes = 2;
+
+  protected:
+    virtual void header(std::string &out, std::string const &name, size_t size) override;
+    virtual void record(std::string &out, size_t address, unsigned char const *data, size_t n) override;
+    virtual void footer(std::string &out, size_t records, size_t size) override;
+
+  public:
+    using RecordWriter::RecordWriter;
+    virtual std::vector<std::string> extensions() const override {
+      return {".srec", ".s19", ".s28", ".s37", ".mot"};
+    }
+    virtual std::string format() const override {
+      return "Motorola S-record";
+    }
+  };
+
+  // Writes the images to a C/C++ source file and a header. By default, the images are plain arrays;
+  // with Style::RLE they are run-length encoded, and the header contains a decompressor that streams
+  // the bytes of an image using constant memory. Style::TABLE writes a single table of control words
+  // indexed by logical address instead, together with constants for the signals, opcodes and flags
+  // and a function that composes the address. Style::CONSTEXPR writes the same as a C++20 header
+  // only, in which everything is constexpr and control words are decoded into signal sets.
+  class CPPWriter: public Writer {
+  public:
+    enum class Style {
+      ARRAYS,
+      RLE,
+      TABLE,
+      CONSTEXPR
+    };
+
+  private:
+    Style _style = Style::ARRAYS;
+
+  public:
     using Writer::Writer;
+    void setStyle(Style style) { _style = style; }
     virtual WriteResult write(Result const &result) override;
     virtual std::vector<std::string> extensions() const override {
       return {".cc", ".cpp", ".cxx", ".c"};
@@ -108,7 +444,7 @@ namespace Mugen {
     }
   };
 
-  using Writers = std::tuple<BinaryFileWriter, CPPWriter>;
+  using Writers = std::tuple<BinaryFileWriter, CPPWriter, IntelHexWriter, SRecordWriter>;
 }
 
 #endif
@@ -0,0 +1,122 @@
+#include <new>
+
+#include "mugen.h"
+#include "mugen_c.h"
+
+struct mugen_context {
+  Mugen::Result result;
+  bool valid = false;
+  std::vector<Mugen::Diagnostic> diagnostics;
+  std::vector<mugen_diagnostic> view;
+};
+
+namespace {
+
+  Mugen::Options convert(mugen_options const *opt, std::vector<Mugen::Diagnostic> &diagnostics) {
+    mugen_options defaults;
+    mugen_options_init(&defaults);
+    if (!opt) opt = &defaults;
+
+    Mugen::Options result;
+    result.lsbFirst = !opt->msb_first;
+    result.padImages = (opt->padding == MUGEN_PAD_VALUE) ? Mugen::Options::Padding::VALUE
+                     : (opt->padding == MUGEN_PAD_CATCH) ? Mugen::Options::Padding::CATCH
+                     : Mugen::Options::Padding::NONE;
+    result.padValue = opt->pad_value;
+    result.jobs = opt->jobs;
+    result.onDiagnostic = [&diagnostics](Mugen::Diagnostic const &diag) {
+      diagnostics.push_back(diag);
+    };
+    return result;
+  }
+
+  // Runs generate() and stores its result and diagnostics in the context. Exceptions never
+  // cross the C interface; anything other than Mugen::Error is reported as an error as well.
+  template <typename Generate>
+  int run(mugen_context *ctx, std::string const &name, mugen_options const *opt, Generate &&generate) {
+    ctx->diagnostics.clear();
+    ctx->view.clear();
+
+    int status = 0;
+    try {
+      ctx->result = generate(convert(opt, ctx->diagnostics));
+      ctx->valid = true;
+    }
+    catch (Mugen::Error const &) {
+      status = 1;
+    }
+    catch (std::exception const &e) {
+      ctx->diagnostics.push_back({Mugen::Diagnostic::Severity::ERROR, name, 0, e.what()});
+      status = 1;
+    }
+    catch (...) {
+      ctx->diagnostics.push_back({Mugen::Diagnostic::Severity::ERROR, name, 0, "unknown error."});
+      status = 1;
+    }
+
+    for (Mugen::Diagnostic const &diag: ctx->diagnostics) {
+      ctx->view.push_back({
+          diag.severity == Mugen::Diagnostic::Severity::ERROR ? MUGEN_ERROR : MUGEN_WARNING,
+          diag.file.c_str(),
+          diag.line,
+          diag.message.c_str()
+        });
+    }
+    return status;
+  }
+}
+
+extern "C" {
+
+  void mugen_options_init(mugen_options *opt) {
+    opt->msb_first = 0;
+    opt->padding = MUGEN_PAD_NONE;
+    opt->pad_value = 0;
+    opt->jobs = 1;
+  }
+
+  mugen_context *mugen_create(void) {
+    return new (std::nothrow) mugen_context;
+  }
+
+  void mugen_destroy(mugen_context *ctx) {
+    delete ctx;
+  }
+
+  int mugen_generate_file(mugen_context *ctx, const char *filename, const mugen_options *opt) {
+    return run(ctx, filename, opt, [&](Mugen::Options const &options) {
+      return Mugen::generate(filename, options);
+    });
+  }
+
+  int mugen_generate_source(mugen_context *ctx, const char *source, size_t size,
+                            const char *name, const mugen_options *opt) {
+    std::string const specName = name ? name : "<source>";
+    return run(ctx, specName, opt, [&](Mugen::Options const &options) {
+      return Mugen::generateFromSource({source, size}, specName, options);
+    });
+  }
+
+  size_t mugen_image_count(const mugen_context *ctx) {
+    return ctx->valid ? ctx->result.images.size() : 0;
+  }
+
+  const unsigned char *mugen_image(const mugen_context *ctx, size_t idx, size_t *size) {
+    if (idx >= mugen_image_count(ctx)) return nullptr;
+    Mugen::Image const &image = ctx->result.images[idx];
+    if (size) *size = image.size();
+    return image.data();
+  }
+
+  size_t mugen_diagnostic_count(const mugen_context *ctx) {
+    return ctx->view.size();
+  }
+
+  const mugen_diagnostic *mugen_diagnostic_at(const mugen_context *ctx, size_t idx) {
+    return (idx < ctx->view.size()) ? &ctx->view[idx] : nullptr;
+  }
+
+  int mugen_rule_line(const mugen_context *ctx, size_t address) {
+    return ctx->valid ? Mugen::ruleLineAt(ctx->result, address) : 0;
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef MUGEN_C_H
+#define MUGEN_C_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  // C interface to libmugen. A context holds the images and diagnostics of the most recent
+  // generation; contexts are independent and may be used on different threads at the same time.
+  typedef struct mugen_context mugen_context;
+
+  typedef enum {
+    MUGEN_PAD_NONE,
+    MUGEN_PAD_VALUE,
+    MUGEN_PAD_CATCH
+  } mugen_padding;
+
+  typedef enum {
+    MUGEN_WARNING,
+    MUGEN_ERROR
+  } mugen_severity;
+
+  typedef struct {
+    int msb_first;
+    mugen_padding padding;
+    unsigned char pad_value;
+    size_t jobs;  // 1 to 1024; larger values are reported as an error
+  } mugen_options;
+
+  typedef struct {
+    mugen_severity severity;
+    const char *file;
+    int line;
+    const char *message;
+  } mugen_diagnostic;
+
+  void mugen_options_init(mugen_options *opt);
+
+  mugen_context *mugen_create(void);
+  void mugen_destroy(mugen_context *ctx);
+
+  // Return 0 on success. On failure, the images of the previous successful call remain
+  // available and the diagnostics describe the error. opt may be NULL for the defaults.
+  int mugen_generate_file(mugen_context *ctx, const char *filename, const mugen_options *opt);
+  int mugen_generate_source(mugen_context *ctx, const char *source, size_t size,
+                            const char *name, const mugen_options *opt);
+
+  // The images are owned by the context and stay valid until the next successful call
+  size_t mugen_image_count(const mugen_context *ctx);
+  const unsigned char *mugen_image(const mugen_context *ctx, size_t idx, size_t *size);
+
+  // Diagnostics of the most recent call; they stay valid until the next call
+  size_t mugen_diagnostic_count(const mugen_context *ctx);
+  const mugen_diagnostic *mugen_diagnostic_at(const mugen_context *ctx, size_t idx);
+
+  // Line of the rule that produced the word at the given address, or 0 if there is none
+  int mugen_rule_line(const mugen_context *ctx, size_t address);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -88,51 +88,25 @@ namespace Mugen {
       return;
     }
     
-    // Build address string
-    std::string addressString(result.address.total_address_bits, '0');
-    auto insertIntoAddressString = [&addressString](std::string const &bitString, int bits_start) {
-      addressString.replace(addressString.length() - bits_start - bitString.length(), bitString.length(), bitString);
+    auto const &address = result.address;
+    auto field = [](size_t bits, size_t start) {
+      return bits << start;
     };
     
-    // Insert opcode bits
-    std::string opcodeBits = toBinaryString(result.opcodes.find(opcode)->second, result.address.opcode_bits);
-    insertIntoAddressString(opcodeBits, result.address.opcode_bits_start);
+    // Build the address from the opcode and flags
+    size_t base = field(result.opcodes.find(opcode)->second, address.opcode_bits_start);
+    for (size_t idx = 0; idx != address.flag_bits; ++idx)
+      base |= field(state[idx], address.flag_bits_start + idx);
     
-    // Insert flag bits
-    std::string flagBits(result.address.flag_bits, ' ');
-    for (size_t idx = 0; idx != result.address.flag_bits; ++idx)
-      flagBits[flagBits.length() - idx - 1] = state[idx] ? '1' : '0';
-    insertIntoAddressString(flagBits, result.address.flag_bits_start);
-    
-    // Iterate over cycles and collect signals on every cycle
+    // Iterate over cycles and collect signals on every cycle. The control word is obtained from
+    // the rule that applies to the address, rather than decoded from the images (which are not
+    // generated in debug mode).
     for (size_t cycle = 0; cycle != maxCycles; ++cycle) {
       Signals activeSignals;
       
-      // Insert cycle bits
-      std::string cycleBits = toBinaryString(cycle, result.address.cycle_bits);
-      insertIntoAddressString(cycleBits, result.address.cycle_bits_start);
-      
-      // Iterate over segments
-      size_t nSegments = (1 << result.address.segment_bits);
-      for (size_t segment = 0; segment != nSegments; ++segment) {
-        
-        // Insert segment bits (if segmented)
-        if (nSegments > 1) {
-          std::string segmentStr = toBinaryString(segment, result.address.segment_bits);
-          insertIntoAddressString(segmentStr, result.address.segment_bits_start);
-        }
-	size_t const address = std::stoi(addressString, nullptr, 2);
-        
-        // Iterate over roms and fetch signals
-        for (size_t romIndex = 0; romIndex != result.rom.rom_count; ++romIndex) {
-          unsigned char word = result.images[romIndex][address];
-          for (size_t bit = 0; bit != result.rom.bits_per_word; ++bit) {
-            if (word & (1 << bit)) {
-              size_t signalIndex = (segment * result.rom.rom_count + romIndex) * result.rom.bits_per_word + bit;
-              activeSignals.push_back(result.signals[signalIndex]);
-            }
-          }
-        }
+      uint64_t const word = controlWordAt(result, base | field(cycle, address.cycle_bits_start));
+      for (size_t idx = 0; idx != result.signals.size(); ++idx) {
+        if ((word >> idx) & 1) activeSignals.push_back(result.signals[idx]);
       }
       
       // Print list of signals active on this cycle
@@ -146,7 +120,7 @@ namespace Mugen {
   }
   
   void printOpcodes(Result const &result) {
-    std::vector<std::string> sorted(1 << result.address.opcode_bits);
+    std::vector<std::string> sorted(size_t{1} << result.address.opcode_bits);
     size_t maxWidth = 0;
     for (auto const &[str, value]: result.opcodes) {
       sorted[value] = str;
@@ -171,19 +145,19 @@ namespace Mugen {
       return (std::cout << std::setw(15) << std::setfill(' ') << str << ": ");
     };
     
-    size_t nImages = result.images.size();
+    size_t nImages = result.rom.rom_count;
     property("#images") << nImages << '\n';
     property("file format") << Writer::get(outFileBase)->format() << '\n';
     
-    property("image size") << result.images[0].size() << " bytes (";
-    if (result.images[0].size() <= (1UL << result.address.total_address_bits)) {
+    property("image size") << imageSize(result) << " bytes (";
+    if (imageSize(result) <= (1UL << result.address.total_address_bits)) {
       std::cout << "not ";
     }
     std::cout << "padded)\n"; 
     
     property("segmented") << (result.address.segment_bits > 0 ? "yes" : "no");
     if (result.address.segment_bits > 0)
-      std::cout << ", " << (1 << result.address.segment_bits) << " segments per image.";
+      std::cout << ", " << (size_t{1} << result.address.segment_bits) << " segments per image.";
     std::cout << '\n';
     
     property("#signals") << result.signals.size() << '\n';
@@ -219,8 +193,10 @@ namespace Mugen {
       auto [input, good] = promptAndGetInput();
       if (!good) return false;
 
-      auto args = split(input, ' ');
-      if (args.empty()) continue;
+      auto words = split(input, ' ');
+      if (words.empty()) continue;
+
+      std::vector<std::string> args(words.begin(), words.end());
 
       auto [quit, write] = cli.exec(args);
       if (quit) return write;
@@ -1,54 +1,508 @@
 #include <fstream>
 #include <unordered_map>
-#include <unordered_set>
 #include <functional>
 #include <algorithm>
 #include <sstream>
+#include <bit>
+#include <cstring>
+#include <atomic>
+#include <map>
+#include <future>
+#include <system_error>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "linenoise/linenoise.h"
 #include "mugen.h"
 #include "util.h"
+#include "parallel.h"
 
 namespace Mugen {
 
   static std::string const s_empty = "__EMPTY__";
   
+  // Contents of a section, as a view into the specification file. It starts right after the
+  // opening brace, on line lineNr, and still contains the comments.
   struct Body {
-    std::string str;
-    int lineNr;
+    std::string_view str;
+    int lineNr = 0;
   };
   
   struct Opcode {
     std::string ident;
     size_t value;
   };
+
+  // Every identifier in the specification is interned once and referred to by its id afterwards.
+  // A name can have several meanings at the same time (e.g. an opcode and a flag with the same
+  // name), so the info of each id records all of them.
+  struct Symbols {
+    struct Info {
+      int signal = -1;               // index of the signal
+      int flag = -1;                 // index of the flag label
+      bool isOpcode = false;
+      size_t opcode = 0;
+      bool isMacro = false;
+      uint64_t macro = 0;            // signals of the macro, with nested macros resolved
+      size_t macroDepth = 0;         // 1 for a macro of signals only, one more per level of nesting
+      
+      bool operator==(Info const &) const = default;
+    };
+    
+    SymbolTable table;
+    std::vector<Info> info;
+    
+    uint32_t intern(std::string_view name) {
+      uint32_t const id = table.insert(name);
+      if (id == info.size()) info.emplace_back();
+      return id;
+    }
+    
+    uint32_t find(std::string_view name) const {
+      return table.find(name);
+    }
+  };
+
+  // An address pattern: every bit set in mask must equal the corresponding bit in value,
+  // all other bits are wildcards.
+  struct Rule {
+    size_t mask = 0;
+    size_t value = 0;
+    uint64_t bitvector = 0;
+    int lineNr = 0;
+    bool catchAll = false;
+
+    // Fixes the nBits-wide field starting at bit 'start' to the given bits
+    void insert(size_t bits, size_t nBits, size_t start) {
+      size_t const fieldMask = ((size_t{1} << nBits) - 1) << start;
+      mask |= fieldMask;
+      value = (value & ~fieldMask) | ((bits << start) & fieldMask);
+    }
+  };
+  
+  void append(Rules &rules, Rule const &rule) {
+    rules.mask.push_back(rule.mask);
+    rules.value.push_back(rule.value);
+    rules.signals.push_back(rule.bitvector);
+    rules.lineNr.push_back(rule.lineNr);
+    rules.catchAll.push_back(rule.catchAll);
+  }
+  
+  Rule getRule(Rules const &rules, size_t idx) {
+    return {rules.mask[idx], rules.value[idx], rules.signals[idx], rules.lineNr[idx], rules.catchAll[idx]};
+  }
+
+  // A set of addresses start, start + stride, ..., start + (count - 1) * stride
+  struct Run {
+    size_t start;
+    size_t count;
+    size_t stride;
+  };
+
+  // Applies func to every run of addresses matching the rule, in ascending order. The lowest block of
+  // adjacent wildcard bits determines the stride and length of the runs (when it includes bit 0, the runs
+  // are contiguous). The remaining wildcard bits are enumerated by counting through all subsets of their mask.
+  template <typename Function>
+  void forEachRun(Rule const &rule, size_t addressBits, Function &&func) {
+    size_t const wildcards = ~rule.mask & ((size_t{1} << addressBits) - 1);
+    size_t const base = rule.value & ~wildcards;
+    if (wildcards == 0) return func(Run{base, 1, 1});
+
+    size_t const strideBit = std::countr_zero(wildcards);
+    size_t const runBits = std::countr_one(wildcards >> strideBit);
+    size_t const outer = wildcards & ~(((size_t{1} << runBits) - 1) << strideBit);
+
+    Run run{base, size_t{1} << runBits, size_t{1} << strideBit};
+    size_t subset = 0;
+    do {
+      run.start = base | subset;
+      func(run);
+      subset = (subset - outer) & outer;
+    } while (subset != 0);
+  }
+  
+  // One bit per address, used to keep track of the addresses that have been written to
+  class Bitmap {
+    std::vector<uint64_t> _words;
+    
+  public:
+    Bitmap(size_t size):
+      _words((size + 63) / 64)
+    {}
+    
+    bool test(size_t idx) const {
+      return (_words[idx / 64] >> (idx % 64)) & 1;
+    }
+    
+    void clear() {
+      std::fill(_words.begin(), _words.end(), 0);
+    }
+    
+    void set(size_t idx) {
+      _words[idx / 64] |= (uint64_t{1} << (idx % 64));
+    }
+    
+    void reset(size_t idx) {
+      _words[idx / 64] &= ~(uint64_t{1} << (idx % 64));
+    }
+    
+    void set(size_t start, size_t count) {
+      forEachWord(start, count, [this](size_t word, uint64_t bits) {
+        _words[word] |= bits;
+      });
+    }
+    
+    // Thread-safe variant of set(), using atomic read-modify-writes. Returns false when any of
+    // the bits had already been set by another rule.
+    bool setConcurrent(size_t start, size_t count) {
+      bool clean = true;
+      forEachWord(start, count, [this, &clean](size_t word, uint64_t bits) {
+        uint64_t const prev = std::atomic_ref<uint64_t>(_words[word]).fetch_or(bits, std::memory_order_relaxed);
+        clean &= ((prev & bits) == 0);
+      });
+      return clean;
+    }
+    
+    // Calls func(word, bits) for every word of the bitmap overlapping [start, start + count)
+    template <typename Function>
+    void forEachWord(size_t start, size_t count, Function &&func) {
+      size_t const end = start + count;
+      while (start != end) {
+        size_t const offset = start % 64;
+        size_t const n = std::min<size_t>(64 - offset, end - start);
+        uint64_t const bits = ((n == 64) ? ~uint64_t{0} : ((uint64_t{1} << n) - 1)) << offset;
+        func(start / 64, bits);
+        start += n;
+      }
+    }
+    
+    // Returns the first index in [start, end) whose bit equals value, or end if there is none
+    size_t find(size_t start, size_t end, bool value) const {
+      while (start < end) {
+        uint64_t word = _words[start / 64] >> (start % 64);
+        if (!value) word = ~word;
+        if (word != 0) return std::min(end, start + std::countr_zero(word));
+        start = (start / 64 + 1) * 64;
+      }
+      return end;
+    }
+  };
+  
+  // Removes the nBits-wide field starting at bit 'start' from x, shifting the higher bits down
+  size_t removeField(size_t x, size_t nBits, size_t start) {
+    size_t const low = x & ((size_t{1} << start) - 1);
+    return low | ((x >> (start + nBits)) << start);
+  }
+  
+  // Inverse of removeField: inserts the field bits at 'start', shifting the higher bits up
+  size_t insertField(size_t x, size_t field, size_t nBits, size_t start) {
+    size_t const low = x & ((size_t{1} << start) - 1);
+    return low | (field << start) | ((x >> start) << (start + nBits));
+  }
+  
+  // Maps a rule onto the logical address space, in which the segment bits are left out
+  Rule removeSegmentBits(Rule rule, AddressMapping const &address) {
+    rule.mask  = removeField(rule.mask,  address.segment_bits, address.segment_bits_start);
+    rule.value = removeField(rule.value, address.segment_bits, address.segment_bits_start);
+    return rule;
+  }
+  
+  // Builds the run-length index of the first nRules rules from their address patterns, without a
+  // table per address. The lowest wildcard bits of a rule (when these include bit 0) span blocks of
+  // contiguous addresses; the blocks of every rule are enumerated in ascending order and merged over
+  // all rules. Addresses not matched by any of the rules are assigned defaultRule.
+  Provenance buildProvenance(Rules const &rules, AddressMapping const &address, size_t nRules, int defaultRule) {
+    size_t const logicalBits = address.total_address_bits - address.segment_bits;
+    size_t const all = (size_t{1} << logicalBits) - 1;
+    
+    // The next block of a rule starts at base | subset, where subset enumerates the other wildcards
+    struct Cursor {
+      size_t base;
+      size_t outer;
+      size_t subset;
+      size_t blockSize;
+    };
+    
+    std::vector<Cursor> cursors(nRules);
+    std::vector<std::pair<size_t, uint32_t>> heap(nRules); // start of the next block, rule
+    for (size_t idx = 0; idx != nRules; ++idx) {
+      Rule const rule = removeSegmentBits(getRule(rules, idx), address);
+      size_t const wildcards = ~rule.mask & all;
+      size_t const block = (size_t{1} << std::countr_one(wildcards)) - 1;
+      cursors[idx] = {rule.value & ~wildcards, wildcards & ~block, 0, block + 1};
+      heap[idx] = {cursors[idx].base, idx};
+    }
+    
+    // The heap is a 4-ary min-heap on the start of the next block, which is shallower than a binary heap
+    auto siftDown = [&heap](size_t idx) {
+      while (true) {
+        size_t const first = 4 * idx + 1;
+        if (first >= heap.size()) break;
+        size_t child = first;
+        for (size_t other = first + 1; other < std::min(first + 4, heap.size()); ++other)
+          if (heap[other].first < heap[child].first) child = other;
+        if (heap[idx].first <= heap[child].first) break;
+        std::swap(heap[idx], heap[child]);
+        idx = child;
+      }
+    };
+    for (size_t idx = heap.size(); idx-- != 0; ) siftDown(idx);
+    
+    Provenance provenance;
+    auto append = [&provenance](size_t start, int rule) {
+      if (provenance.empty() || provenance.back().rule != rule) provenance.push_back({start, rule});
+    };
+    
+    size_t pos = 0;
+    while (!heap.empty()) {
+      auto &[start, rule] = heap.front();
+      Cursor &cursor = cursors[rule];
+      if (start > pos) append(pos, defaultRule);
+      append(start, rule);
+      pos = start + cursor.blockSize;
+      
+      cursor.subset = (cursor.subset - cursor.outer) & cursor.outer;
+      start = cursor.base | cursor.subset;
+      if (cursor.subset == 0) {
+        heap.front() = heap.back();
+        heap.pop_back();
+      }
+      siftDown(0);
+    }
+    if (pos <= all) append(pos, defaultRule);
+    return provenance;
+  }
+  
+  // Contiguous array of control words, aligned for vectorized access
+  using ControlWords = std::vector<uint64_t, AlignedAllocator<uint64_t, 64>>;
+  
+#ifdef __SSE2__
+  // Reverses the bits within each of the 16 bytes
+  inline __m128i reverseBits128(__m128i x) {
+    __m128i const m4 = _mm_set1_epi8(0x0f);
+    __m128i const m2 = _mm_set1_epi8(0x33);
+    __m128i const m1 = _mm_set1_epi8(0x55);
+    x = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(x, 4), m4), _mm_slli_epi16(_mm_and_si128(x, m4), 4));
+    x = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(x, 2), m2), _mm_slli_epi16(_mm_and_si128(x, m2), 2));
+    x = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(x, 1), m1), _mm_slli_epi16(_mm_and_si128(x, m1), 1));
+    return x;
+  }
+  
+  // Collects byte k of each of the 16 control words stored in r[0..7] into a single vector
+  inline __m128i extractPlane(__m128i const *r, int k) {
+    __m128i const shift = _mm_cvtsi32_si128(8 * k);
+    __m128i const lowByte = _mm_set1_epi64x(0xff);
+    __m128i v[8];
+    for (int i = 0; i != 8; ++i)
+      v[i] = _mm_and_si128(_mm_srl_epi64(r[i], shift), lowByte);
+    
+    // Every 64-bit lane holds a value below 256; narrow them down to 16 bytes in three steps
+    __m128i const a = _mm_packs_epi32(_mm_packs_epi32(v[0], v[1]), _mm_packs_epi32(v[2], v[3]));
+    __m128i const b = _mm_packs_epi32(_mm_packs_epi32(v[4], v[5]), _mm_packs_epi32(v[6], v[7]));
+    return _mm_packus_epi16(a, b);
+  }
+#endif
+  
+  // Transposes the control words into one image per chip. Byte k = segment * rom_count + chip
+  // of the word at logical address L ends up in images[chip] at the physical address obtained
+  // by inserting the segment bits into L. Blocks of 16 words are transposed into all byte planes
+  // at once (including the bit-reversal for --msb-first) when SSE2 is available. Only the logical
+  // addresses in [begin, end) are transposed, where words[i] holds the word of logical address
+  // base + i; base and begin must be multiples of 16.
+  void transposeControlWords(ControlWords const &words, size_t base, size_t begin, size_t end,
+                             Result const &result, bool lsbFirst, std::vector<Image> &images) {
+    auto const &address = result.address;
+    size_t const nChips = result.rom.rom_count;
+    // A control word has at most 8 bytes; the remaining planes (chips or segments that receive
+    // no signals) are zero-filled, since the images may come from an arbitrary allocator.
+    size_t const nTotal = nChips << address.segment_bits;
+    size_t const nPlanes = std::min<size_t>(nTotal, sizeof(uint64_t));
+    
+    auto physical = [&address](size_t logical, size_t segment) {
+      return insertField(logical, segment, address.segment_bits, address.segment_bits_start);
+    };
+    
+    size_t idx = begin;
+#ifdef __SSE2__
+    // 16 consecutive logical addresses map to consecutive physical addresses only when the
+    // segment bits (if any) lie above the lowest 4 bits.
+    bool const contiguous = (address.segment_bits == 0 || address.segment_bits_start >= 4);
+    if (contiguous) {
+      for (; idx + 16 <= end; idx += 16) {
+        __m128i r[8];
+        for (int i = 0; i != 8; ++i)
+          r[i] = _mm_load_si128(reinterpret_cast<__m128i const *>(words.data() + (idx - base) + 2 * i));
+        
+        for (size_t k = 0; k != nPlanes; ++k) {
+          __m128i plane = extractPlane(r, k);
+          if (!lsbFirst) plane = reverseBits128(plane);
+          unsigned char *dest = images[k % nChips].data() + physical(idx, k / nChips);
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(dest), plane);
+        }
+        for (size_t k = nPlanes; k != nTotal; ++k) {
+          unsigned char *dest = images[k % nChips].data() + physical(idx, k / nChips);
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(dest), _mm_setzero_si128());
+        }
+      }
+    }
+#endif
+    
+    for (; idx != end; ++idx) {
+      for (size_t k = 0; k != nPlanes; ++k) {
+        unsigned char const byte = (words[idx - base] >> (8 * k)) & 0xff;
+        images[k % nChips][physical(idx, k / nChips)] = (lsbFirst ? byte : reverseBits(byte));
+      }
+      for (size_t k = nPlanes; k != nTotal; ++k)
+        images[k % nChips][physical(idx, k / nChips)] = 0;
+    }
+  }
+  
+  // Size of the images after padding
+  size_t imageSize(Result const &result, Options::Padding padding) {
+    switch (padding) {
+    case Options::Padding::NONE:  return size_t{1} << result.address.total_address_bits;
+    case Options::Padding::VALUE: return result.rom.word_count;
+    case Options::Padding::CATCH: return size_t{1} << result.rom.address_bits;
+    }
+    return 0;
+  }
+  
+  // Allocates the images at their final size, so that padding them does not reallocate
+  std::vector<Image> allocateImages(Result const &result, Options const &opt) {
+    size_t const count = result.rom.rom_count;
+    size_t const size = imageSize(result, opt.padImages);
+    
+    std::vector<Image> images;
+    for (size_t idx = 0; idx != count; ++idx)
+      images.push_back(opt.allocator ? opt.allocator(idx, count, size) : Image(size));
+    return images;
+  }
+  
+  // Parser state is kept per thread, so that multiple specifications can be processed at once
+  thread_local int _lineNr = 0;
+  thread_local std::string _file;
+  thread_local std::ostream *_diagnostics = &std::cerr;
+  thread_local DiagnosticHandler const *_handler = nullptr;
+  thread_local PhaseHandler const *_phases = nullptr;
   
-  int _lineNr = 0;
-  std::string _file;
+  // Installs the parser state for a single call to generate() or update(). The state of an
+  // enclosing call on the same thread (e.g. when a diagnostic handler generates another
+  // specification) is restored afterwards.
+  class ParserScope {
+    int const lineNr;
+    std::string file;
+    std::ostream *const diagnostics;
+    DiagnosticHandler const *const handler;
+    PhaseHandler const *const phases;
+    
+  public:
+    ParserScope(std::string const &filename, Options const &opt):
+      lineNr(std::exchange(_lineNr, 0)),
+      file(std::exchange(_file, filename)),
+      diagnostics(std::exchange(_diagnostics, opt.diagnostics ? opt.diagnostics : &std::cerr)),
+      handler(std::exchange(_handler, opt.onDiagnostic ? &opt.onDiagnostic : nullptr)),
+      phases(std::exchange(_phases, opt.onPhase ? &opt.onPhase : nullptr))
+    {}
+    
+    ~ParserScope() {
+      _lineNr = lineNr;
+      _file = std::move(file);
+      _diagnostics = diagnostics;
+      _handler = handler;
+      _phases = phases;
+    }
+  };
+  
+  // Reports the time from its construction to its destruction as a phase to Options::onPhase.
+  // Phases that are left through an exception are not reported.
+  class PhaseTimer {
+    char const *const phase;
+    int const exceptions = std::uncaught_exceptions();
+    Clock::time_point const begin = _phases ? Clock::now() : Clock::time_point{};
+    
+  public:
+    PhaseTimer(char const *name):
+      phase(name)
+    {}
+    
+    ~PhaseTimer() {
+      if (_phases && std::uncaught_exceptions() == exceptions)
+        (*_phases)(phase, begin, Clock::now());
+    }
+  };
   
   template <typename ... Args>
-  void error(Args ... args) {
-    (std::cerr << Mugen::_file << ":" << Mugen::_lineNr << ": ERROR: " <<  ... << args) << '\n';
-    std::exit(1);
+  void report(Diagnostic::Severity severity, Args const & ... args) {
+    if (_handler) {
+      std::ostringstream msg;
+      (msg << ... << args);
+      (*_handler)({severity, _file, _lineNr, msg.str()});
+      return;
+    }
+    
+    char const *label = (severity == Diagnostic::Severity::ERROR) ? ": ERROR: " : ": WARNING: ";
+    (*_diagnostics << Mugen::_file << ":" << Mugen::_lineNr << label <<  ... << args) << '\n';
+  }
+  
+  template <typename ... Args>
+  void report_error(Args const & ... args) {
+    report(Diagnostic::Severity::ERROR, args...);
+  }
+  
+  template <typename ... Args>
+  void error(Args const & ... args) {
+    report_error(args...);
+    
+    std::ostringstream msg;
+    (msg << Mugen::_file << ":" << Mugen::_lineNr << ": " <<  ... << args);
+    throw Error(msg.str());
   }
   
   template <typename ... Args>
-  void error_if(bool condition, Args ... args) {
+  void error_if(bool condition, Args const & ... args) {
     if (condition) error(args...);
   }
   
   template <typename ... Args>
-  void warning(Args ... args) {
-    (std::cerr << _file << ":" << _lineNr << ": WARNING: " <<  ... << args) << '\n';
+  void warning(Args const & ... args) {
+    report(Diagnostic::Severity::WARNING, args...);
   }
   
   template <typename ... Args>
-  void warning_if(bool condition, Args ... args) {
+  void warning_if(bool condition, Args const & ... args) {
     if (condition) warning(args...);
   }
   
   
-  void validateIdentifier(std::string const &ident) {
+  // Calls func(line) for every non-empty line of the body, with comments and surrounding whitespace
+  // removed, while _lineNr holds the number of that line. Afterwards, _lineNr is the number of the
+  // line following the last non-empty line.
+  template <typename Function>
+  void forEachLine(Body const &body, Function &&func) {
+    std::string_view str = body.str;
+    int lineNr = body.lineNr;
+    int endLineNr = body.lineNr;
+    
+    while (true) {
+      size_t const eol = str.find('\n');
+      std::string_view line = str.substr(0, eol);
+      line = trim(line.substr(0, line.find('#')));
+      if (!line.empty()) {
+        _lineNr = lineNr;
+        func(line);
+        endLineNr = lineNr + 1;
+      }
+      
+      if (eol == std::string_view::npos) break;
+      str.remove_prefix(eol + 1);
+      ++lineNr;
+    }
+    
+    _lineNr = endLineNr;
+  }
+  
+  void validateIdentifier(std::string_view ident) {
     error_if(!isalpha(ident[0]) && ident[0] != '_',
              "Identifier \"", ident, "\" does not start with a letter or underscore.");
     
@@ -62,19 +516,11 @@ namespace Mugen {
     error_if(ident == "x" || ident == "X", "\"x\" and \"X\" may not be used as identifiers.");
   }
   
-  Signals parseSignals(Body const &body, Result const &result) {
+  Signals parseSignals(Body const &body, Result const &result, Symbols &symbols) {
+    PhaseTimer timer("parseSignals");
     
-    std::istringstream iss(body.str);
     Signals signals;
-    std::string ident;
-    _lineNr = body.lineNr;
-    while (std::getline(iss, ident)) {
-      trim(ident);
-      if (ident.empty()) {
-        ++_lineNr;
-        continue;
-      }
-
+    forEachLine(body, [&](std::string_view ident) {
       if (ident[0] == '-') {
 	error_if(ident.size() > 1,
 		 "expected signal identifier or dash ('-') to declare an empty signal.");
@@ -83,12 +529,13 @@ namespace Mugen {
       }
       
       validateIdentifier(ident);
-      error_if(ident != s_empty && std::find(signals.begin(), signals.end(), ident) != signals.end(),
+      auto &info = symbols.info[symbols.intern(ident)];
+      error_if(ident != s_empty && info.signal != -1,
                "duplicate definition of signal \"", ident, "\".");
       
-      signals.push_back(ident);
-      ++_lineNr;
-    }
+      if (info.signal == -1) info.signal = signals.size();
+      signals.emplace_back(ident);
+    });
     
     error_if(signals.size() > 64, "more than 64 signals declared.");
     
@@ -105,7 +552,7 @@ namespace Mugen {
     warning_if(segmentBitsRequired < segmentBits && !warned,
                "for ", signals.size(), " signals, it is sufficient to use only ", segmentBitsRequired," segment bit(s) (when using ", romCount, " ROM chips).");
     
-    size_t partsAvailable = romCount * (1 << segmentBits);
+    size_t partsAvailable = romCount * (size_t{1} << segmentBits);
     size_t nParts = (signals.size() + 7) / 8;
     error_if(nParts > partsAvailable,
              "too many signals declared (", signals.size(),"). In this configuration (", romCount,
@@ -114,31 +561,22 @@ namespace Mugen {
     return signals;
   }
   
-  Opcodes parseOpcodes(Body const &body, Result const &result) {
+  Opcodes parseOpcodes(Body const &body, Result const &result, Symbols &symbols) {
+    PhaseTimer timer("parseOpcodes");
     
-    auto constructOpcode = [](std::string const &lhs, std::string const &rhs) -> std::pair<std::string, size_t> {
+    auto constructOpcode = [](std::string_view lhs, std::string_view rhs) -> std::pair<std::string, size_t> {
       validateIdentifier(lhs);
       int value;
       error_if(!stringToInt(rhs, value, 16),
                "value assigned to opcode \"", rhs, "\" is not a valid hexadecimal number.");
-      return {lhs, static_cast<size_t>(value)};
+      return {std::string(lhs), static_cast<size_t>(value)};
     };
     
     
-    std::istringstream iss(body.str);
     Opcodes opcodes;
-    std::string line;
-    _lineNr = body.lineNr;
-    
-    while (std::getline(iss, line)) {
-      trim(line);
-      if (line.empty()) {
-        ++_lineNr;
-        continue;
-      }
-      
-      
-      std::vector<std::string> operands = split(line, '=');
+    std::unordered_map<size_t, std::vector<std::string>> byValue;
+    forEachLine(body, [&](std::string_view line) {
+      std::vector<std::string_view> operands = split(line, '=');
       error_if(operands.size() == 1,
                "expected \"=\" in opcode definition.");
             
@@ -147,100 +585,133 @@ namespace Mugen {
       
       auto [ident, value] = constructOpcode(operands[0], operands[1]);
       size_t const maxOpcodeBits = result.address.opcode_bits;
-      error_if(value >= (1U << maxOpcodeBits),
+      error_if(value >= (size_t{1} << maxOpcodeBits),
                "value assigned to opcode \"", ident, "\" (", value, ") does not fit inside ", maxOpcodeBits, " bits.");
       
-      bool success = opcodes.insert({ident, value}).second;
-      error_if(!success,
+      auto &info = symbols.info[symbols.intern(ident)];
+      error_if(info.isOpcode,
                "duplicate definition of opcode \"", ident, "\".");
       
-      for (auto const &[other, otherValue]: opcodes) {
-        if (other == ident) continue;
-        warning_if(value == otherValue,
-                   "signals \"", ident, "\" and \"", other, "\" are defined with the same value (", value, ").");
-      }
+      info.isOpcode = true;
+      info.opcode = value;
+      opcodes.insert({ident, value});
       
-      ++_lineNr;
-    }
+      auto &others = byValue[value];
+      for (std::string const &other: others) {
+        warning("signals \"", ident, "\" and \"", other, "\" are defined with the same value (", value, ").");
+      }
+      others.push_back(ident);
+    });
     
     return opcodes;
   }
   
-  Macros parseMacros(Body const &body, Result const &result) {
-    std::istringstream iss(body.str);
-    Macros macros;
-    std::string line;
-    _lineNr = body.lineNr;
+  // Macros may refer to other macros, including ones defined further down the section. All
+  // definitions are collected first and resolved into their signal bitmasks afterwards, in
+  // depth-first order, which also detects macros that (indirectly) refer to themselves.
+  Macros parseMacros(Body const &body, Symbols &symbols) {
+    PhaseTimer timer("parseMacros");
     
-    while (std::getline(iss, line)) {
-      trim(line);
-      if (line.empty()) {
-        ++_lineNr;
-        continue;
-      }
-      
-      
-      std::vector<std::string> operands = split(line, '=');
+    struct Definition {
+      uint32_t id;
+      int lineNr;
+      std::vector<std::string_view> rhs;
+    };
+    
+    Macros macros;
+    std::vector<Definition> definitions;
+    forEachLine(body, [&](std::string_view line) {
+      std::vector<std::string_view> operands = split(line, '=');
       error_if(operands.size() == 1,
                "expected \"=\" in macro definition.");
             
       error_if(operands.size() != 2,
                "incorrect opcode format, should be of the form <MACRO> = <SIGNAL1>, <SIGNAL2>, ...");
 
-      std::string ident = operands[0];
+      std::string_view ident = operands[0];
       validateIdentifier(ident);
-      for (std::string const &signal: result.signals) {
-	error_if(ident == signal,
-		 "macro-identifier \"", ident, "\" clashes with previously defined signal \"", signal, "\".");
-      }
+      uint32_t const id = symbols.intern(ident);
+      error_if(symbols.info[id].signal != -1,
+               "macro-identifier \"", ident, "\" clashes with previously defined signal \"", ident, "\".");
 
-      Signals macroSignals;
-      std::vector<std::string> rhs = split(operands[1], ',');
-      for (std::string const &signal: rhs) {
-        bool validSignal = false;
-        for (size_t idx = 0; idx != result.signals.size(); ++idx) {
-          if (result.signals[idx] != signal) continue;
-          validSignal = true;
-          break;
-        }
+      auto &info = symbols.info[id];
+      error_if(info.isMacro,
+	       "duplicate definition of macro \"", ident, "\".");
 
-        error_if(!validSignal && !macros.contains(signal),
+      info.isMacro = true;
+      definitions.push_back({id, _lineNr, split(operands[1], ',')});
+      macros.insert({std::string(ident), Signals(definitions.back().rhs.begin(), definitions.back().rhs.end())});
+    });
+    
+    int const endLineNr = _lineNr;
+    std::vector<int> definitionOf(symbols.info.size(), -1);
+    for (size_t idx = 0; idx != definitions.size(); ++idx)
+      definitionOf[definitions[idx].id] = idx;
+    
+    enum class Mark { NONE, ACTIVE, DONE };
+    std::vector<Mark> marks(definitions.size(), Mark::NONE);
+    std::vector<size_t> path;
+    
+    auto resolve = [&](auto const &self, size_t idx) -> uint64_t {
+      Definition const &def = definitions[idx];
+      auto &info = symbols.info[def.id];
+      if (marks[idx] == Mark::DONE) return info.macro;
+      
+      _lineNr = def.lineNr;
+      if (marks[idx] == Mark::ACTIVE) {
+        std::string cycle;
+        for (auto it = std::find(path.begin(), path.end(), idx); it != path.end(); ++it)
+          cycle += symbols.table.name(definitions[*it].id) + " -> ";
+        error("cyclic macro definition: ", cycle, symbols.table.name(def.id), ".");
+      }
+      
+      marks[idx] = Mark::ACTIVE;
+      path.push_back(idx);
+      
+      uint64_t signals = 0;
+      size_t depth = 1;
+      for (std::string_view signal: def.rhs) {
+        uint32_t const ref = symbols.find(signal);
+        int const refSignal = (ref == SymbolTable::npos) ? -1 : symbols.info[ref].signal;
+        int const refMacro  = (ref == SymbolTable::npos) ? -1 : definitionOf[ref];
+        
+        _lineNr = def.lineNr;
+        error_if(refSignal == -1 && refMacro == -1,
                  "signal \"", signal, "\" not declared in signal section.");
-
-	macroSignals.push_back(signal);
+        
+        if (refMacro != -1) {
+          signals |= self(self, refMacro);
+          depth = std::max(depth, symbols.info[ref].macroDepth + 1);
+        }
+        else signals |= (uint64_t{1} << refSignal);
       }
-
-      bool success = macros.insert({ident, macroSignals}).second;
-      error_if(!success,
-	       "duplicate definition of macro \"", ident, "\".");
-
-      ++_lineNr;
-    }
-
+      
+      path.pop_back();
+      marks[idx] = Mark::DONE;
+      info.macroDepth = depth;
+      return info.macro = signals;
+    };
+    
+    for (size_t idx = 0; idx != definitions.size(); ++idx) 
+      resolve(resolve, idx);
+    
+    _lineNr = endLineNr;
     return macros;
   }
   
-  AddressMapping parseAddressMapping(Body const &body, Result const &result) {
+  AddressMapping parseAddressMapping(Body const &body, Result const &result, Symbols &symbols) {
+    PhaseTimer timer("parseAddressMapping");
     
-    std::istringstream iss(body.str);
     AddressMapping address;
-    _lineNr = body.lineNr;   
-    std::string line;
     size_t count = 0;
     
-    while (std::getline(iss, line)) {
-      trim(line);
-      if (line.empty()) {
-        ++_lineNr;
-        continue;
-      }
-      
-      std::vector<std::string> operands = split(line, ':');
+    forEachLine(body, [&](std::string_view line) {
+      std::vector<std::string_view> operands = split(line, ':');
       error_if(operands.size() != 2,
                "invalid format for address specifier, should be <IDENTIFIER>: <NUMBER OF BITS>.");
       
-      std::string const &ident = operands[0];
-      std::string const &rhs = operands[1];
+      std::string_view ident = operands[0];
+      std::string_view rhs = operands[1];
       
       auto parseField = [&ident, &rhs, &count](size_t &bits, size_t &start, int minValue, auto &&parseRhs){
         error_if(bits > 0,
@@ -270,15 +741,18 @@ namespace Mugen {
         });
       }
       else if (ident == "flags") {
-        parseField(address.flag_bits, address.flag_bits_start, 0, [&address](std::string const &str, int &bits) {
+        parseField(address.flag_bits, address.flag_bits_start, 0, [&address, &symbols](std::string_view str, int &bits) {
           if (stringToInt(str, bits)) return true;
           
           // Not a number -> interpret as labels
-          address.flag_labels = split(str, ',');
-          std::unordered_set<std::string> set;
-          for (std::string &label: address.flag_labels) {
-            warning_if(!set.insert(label).second,
+          auto labels = split(str, ',');
+          address.flag_labels.assign(labels.begin(), labels.end());
+          for (size_t idx = 0; idx != address.flag_labels.size(); ++idx) {
+            std::string const &label = address.flag_labels[idx];
+            auto &info = symbols.info[symbols.intern(label)];
+            warning_if(info.flag != -1,
                        "duplicate flag \"", label, "\".");
+            if (info.flag == -1) info.flag = idx;
           }
           
           bits = address.flag_labels.size();
@@ -291,9 +765,7 @@ namespace Mugen {
         });
       }
       else error("unknown address field \"", ident, "\".");
-      
-      ++_lineNr;
-    }
+    });
     
     
     error_if(count > result.rom.address_bits,
@@ -312,23 +784,16 @@ namespace Mugen {
   
   
   RomSpecs parseRomSpecs(Body const &body) {
+    PhaseTimer timer("parseRomSpecs");
     
-    std::istringstream iss(body.str);
-    _lineNr = body.lineNr;
     RomSpecs result;
     bool done = false;
-    std::string line;
     
-    while (std::getline(iss, line)) {
-      trim(line);
-      if (line.empty()) {
-        ++_lineNr;
-        continue;
-      }
+    forEachLine(body, [&](std::string_view line) {
       error_if(done,
                "rom specification can only contain at most 1 non-empty line.");
       
-      std::vector<std::string> values = split(line, 'x');
+      std::vector<std::string_view> values = split(line, 'x');
       error_if(values.size() < 2 || values.size() > 3,
                "invalid format for rom specification, should be <NUMBER OF WORDS> x <BITS_PER_WORD> "
                "or <NUMBER OF WORDS> x <BITS_PER_WORD> x <NUMBER_OF_CHIPS>.");
@@ -355,14 +820,16 @@ namespace Mugen {
       else result.rom_count = 1;
             
       done = true;
-      ++_lineNr;
-    }
+    });
     
     result.address_bits = bitsNeeded(result.word_count);
     return result;
   }
   
-  std::unordered_map<std::string, Body> parseTopLevel(std::istream &file) {
+  // Splits the specification into its sections in a single pass. The bodies are views into the
+  // source, so nothing is copied.
+  std::unordered_map<std::string, Body> parseTopLevel(std::string_view source) {
+    PhaseTimer timer("parseTopLevel");
     
     enum State {
       PARSING_TOP_LEVEL,
@@ -377,18 +844,20 @@ namespace Mugen {
     
     _lineNr = 1;
     std::unordered_map<std::string, Body> result;
-    std::string currentSection;
-    std::string currentBody;
-    int bodyLineNr;
-    bool isFirstCharacterOfBody;
-    char ch;
+    size_t headerStart = 0;
+    std::string_view currentSection;
+    Body currentBody;
     
-    while (file.get(ch)) {
+    for (size_t pos = 0; pos != source.size(); ++pos) {
+      char const ch = source[pos];
       if (ch == '\n') ++_lineNr;
       
       switch (state) {
       case PARSING_TOP_LEVEL: {
-        if (ch == '[') state = PARSING_SECTION_HEADER;
+        if (ch == '[') {
+          state = PARSING_SECTION_HEADER;
+          headerStart = pos + 1;
+        }
         else if (ch == '#') {
           stateBeforeComment = state;
           state = PARSING_COMMENT;
@@ -404,8 +873,10 @@ namespace Mugen {
         error_if(ch == '#',
                  "cannot place comments inside a section header.");
           
-        if (ch == ']') state = LOOKING_FOR_OPENING_BRACE;
-        else currentSection += ch;
+        if (ch == ']') {
+          state = LOOKING_FOR_OPENING_BRACE;
+          currentSection = trim(source.substr(headerStart, pos - headerStart));
+        }
         break;
       }
       case LOOKING_FOR_OPENING_BRACE: {
@@ -418,7 +889,7 @@ namespace Mugen {
           error_if(ch != '{',
                    "expected '{' before '", ch, "' in section definition.");
           state = PARSING_SECTION_BODY;
-          isFirstCharacterOfBody = true;
+          currentBody = {source.substr(pos + 1, 0), _lineNr};
         }
         break;
       }
@@ -426,39 +897,22 @@ namespace Mugen {
         error_if(ch == '[',
                  "expected '}' before '", ch, "' in section definition.");
           
-        if (ch != '}') {
-          if (ch == '#') {
-            stateBeforeComment = state;
-            state = PARSING_COMMENT;
-            break;
-          }
-          else if (!std::isspace(ch) && isFirstCharacterOfBody) {
-            bodyLineNr = _lineNr;
-            isFirstCharacterOfBody = false;
-          }
-          currentBody += ch;
-          break;
+        if (ch == '#') {
+          stateBeforeComment = state;
+          state = PARSING_COMMENT;
         }
-        else {
-          trim(currentSection);
-          trim(currentBody);
-          error_if(!result.insert({currentSection, {currentBody, bodyLineNr}}).second,
+        else if (ch == '}') {
+          size_t const start = currentBody.str.data() - source.data();
+          currentBody.str = source.substr(start, pos - start);
+          error_if(!result.insert({std::string(currentSection), currentBody}).second,
                    "multiple definitions of section \"", currentSection, "\".");
-            
-          currentSection.clear();
-          currentBody.clear();
+          
           state = PARSING_TOP_LEVEL;
-          break;
         }
-        UNREACHABLE;
+        break;
       }
       case PARSING_COMMENT: {
-        if (ch == '\n') {
-          state = stateBeforeComment;
-          if (state == PARSING_SECTION_BODY) { 
-            currentBody += '\n';
-          }
-        }
+        if (ch == '\n') state = stateBeforeComment;
         break;
       }}
     }
@@ -478,117 +932,162 @@ namespace Mugen {
   }
   
   
-  std::vector<Image> parseMicrocode(Body const &body, Result const &result, Options const &opt) {
-    
-    auto const &rom = result.rom;
-    auto const &address = result.address;
-    auto const &signals = result.signals;
-    auto const &macros  = result.macros;
-    auto const &opcodes = result.opcodes;
-    
-    size_t const addressBits = (opt.padImages == Options::Padding::CATCH)
-      ? rom.address_bits
-      : address.total_address_bits;
-    
-    std::vector<Image> images;
-    size_t imageSize = (1 << addressBits);
-    for (size_t chip = 0; chip != rom.rom_count; ++chip) 
-      images.emplace_back(imageSize);
+  // Writes the control word of a (non-catch) rule, given in logical addresses, to every address it
+  // matches, and marks these addresses as visited. Entry i of the arrays belongs to logical address
+  // offset + i. When running concurrently with other rules, the occupancy bits are set atomically.
+  void expandRule(Rule const &rule, size_t logicalBits, size_t offset,
+                  ControlWords &words, Bitmap &visited, bool concurrent) {
     
-    std::vector<size_t> visited(imageSize);
-    std::vector<bool> signalsUsed(signals.size());
-    auto opcodesCopy = opcodes;
-    bool catchRuleDefined = false;
+    auto mark = [&](size_t start, size_t count) {
+      if (!concurrent) return visited.set(start, count);
+      [[maybe_unused]] bool const clean = visited.setConcurrent(start, count);
+      assert(clean && "rules should have been validated for overlap");
+    };
     
-    std::istringstream iss(body.str);
-    _lineNr = body.lineNr;
-    std::string line;
+    forEachRun(rule, logicalBits, [&](Run run) {
+      run.start -= offset;
+      if (run.stride == 1) {
+        std::fill_n(words.data() + run.start, run.count, rule.bitvector);
+        mark(run.start, run.count);
+      }
+      else for (size_t i = 0; i != run.count; ++i) {
+        size_t const idx = run.start + i * run.stride;
+        words[idx] = rule.bitvector;
+        mark(idx, 1);
+      }
+    });
+  }
+  
+  // Writes the control word of the catch rule to every unvisited address in [begin, end)
+  void expandCatch(Rule const &rule, size_t begin, size_t end, ControlWords &words, Bitmap const &visited) {
+    size_t pos = begin;
+    while (pos != end) {
+      size_t const first = visited.find(pos, end, false);
+      pos = visited.find(first, end, true);
+      std::fill(words.begin() + first, words.begin() + pos, rule.bitvector);
+    }
+  }
+  
+  // Reports every pair of rules whose address patterns intersect, without expanding them. Two rules
+  // intersect when they agree on all bits that are fixed in both. Rules that fix the entire opcode
+  // field are bucketed by opcode, so they are only compared to earlier rules for the same opcode and
+  // to earlier rules that (partially) wildcard the opcode.
+  void validateRules(Rules const &rules, AddressMapping const &address, size_t addressBits) {
+    PhaseTimer timer("validateRules");
+    size_t const opcodeMask = ((size_t{1} << address.opcode_bits) - 1) << address.opcode_bits_start;
+    std::unordered_map<size_t, std::vector<size_t>> byOpcode;
+    std::vector<size_t> wildOpcode;
+    std::vector<size_t> candidates;
+    bool conflict = false;
+    size_t covered = 0;
     
-    while (std::getline(iss, line)) {
-      trim(line);
-      if (line.empty() || catchRuleDefined) {
-        ++_lineNr;
+    for (size_t idx = 0; idx != rules.size(); ++idx) {
+      size_t const mask = rules.mask[idx];
+      size_t const value = rules.value[idx];
+      _lineNr = rules.lineNr[idx];
+      
+      if (rules.catchAll[idx]) {
+        // Rules are disjoint at this point, so their match-counts add up
+        warning_if(!conflict && covered == (size_t{1} << addressBits),
+                   "catch rule is never applied; all addresses are covered by preceding rules.");
         continue;
       }
-            
-      std::vector<std::string> operands = split(line, "->", true);
-      error_if(operands.size() == 1,
-               "expected \"->\" in microcode rule.");
-      error_if(operands.size() != 2,
-               "invalid format in microcode definition, should be (<OPCODE>:<CYCLE>:<FLAGS> | catch) -> [SIG1], ...");
       
+      bool const fixedOpcode = (mask & opcodeMask) == opcodeMask;
+      candidates.clear();
+      if (fixedOpcode) {
+        auto const &bucket = byOpcode[value & opcodeMask];
+        std::merge(bucket.begin(), bucket.end(), wildOpcode.begin(), wildOpcode.end(), std::back_inserter(candidates));
+      }
+      else {
+        for (size_t other = 0; other != idx; ++other) candidates.push_back(other);
+      }
       
-      // Build address string, fill with wildcards
-      std::string addressString(addressBits, 'x');
+      for (size_t other: candidates) {
+        if (((value ^ rules.value[other]) & mask & rules.mask[other]) != 0) continue;
+        report_error("rule overlaps with rule previously defined on line ", rules.lineNr[other], ".");
+        conflict = true;
+      }
       
-      // Lambda for inserting bits into the address-string
-      auto insertIntoAddressString = [&addressString](std::string const &bitString, int bits_start) -> void {
-        addressString.replace(addressString.length() - bits_start - bitString.length(), bitString.length(), bitString);
-      };
+      if (fixedOpcode) byOpcode[value & opcodeMask].push_back(idx);
+      else wildOpcode.push_back(idx);
+      
+      size_t const wildcards = ~mask & ((size_t{1} << addressBits) - 1);
+      covered += (size_t{1} << std::popcount(wildcards));
+    }
+    
+    if (conflict) throw Error(_file + ": overlapping rules in microcode section.");
+  }
+  
+  // Ids of the opcode, macros and signals that a rule refers to
+  using Dependencies = std::vector<uint32_t>;
+  
+  // Compiles a single (non-empty) line of the microcode section into a rule. The ids of the names
+  // it refers to are appended to dependencies.
+  Rule compileRule(std::string_view line, Result const &result, Symbols const &symbols, Dependencies &dependencies) {
+    
+    auto const &address = result.address;
+    
+    std::vector<std::string_view> operands = split(line, "->", true);
+    error_if(operands.size() == 1,
+             "expected \"->\" in microcode rule.");
+    error_if(operands.size() != 2,
+             "invalid format in microcode definition, should be (<OPCODE>:<CYCLE>:<FLAGS> | catch) -> [SIG1], ...");
+    
+    
+    // Compile the address into a (mask, value) pair; bits not in the mask are wildcards
+    Rule rule;
+    rule.lineNr = _lineNr;
+    
+    bool catchAll = (operands[0] == "catch");
+    if (!catchAll) {
+      std::vector<std::string_view> lhs = split(operands[0], ':');
+      error_if(!catchAll && (lhs.size() < 2 || lhs.size() > 3),
+               "expected ':' before '->' in rule definition.");
       
+      if (lhs.size() == 2) lhs.push_back({});
       
-      bool catchAll = (operands[0] == "catch");
-      if (!catchAll) {
-        std::vector<std::string> lhs = split(operands[0], ':');
-        error_if(!catchAll && (lhs.size() < 2 || lhs.size() > 3),
-                 "expected ':' before '->' in rule definition.");
+      // Insert opcode bits
+      std::string_view userStr = lhs[0];
+      if (userStr != "x" && userStr != "X") {
+        uint32_t const id = symbols.find(userStr);
+        error_if(id == SymbolTable::npos || !symbols.info[id].isOpcode,
+                 "opcode \"", userStr, "\" not declared in opcode section.");
         
-        if (lhs.size() == 2) lhs.push_back("");
-        
-        // Insert opcode bits
-        std::string userStr = lhs[0];
-        if (userStr != "x" && userStr != "X") {
-          std::string opcodeStr;
-          for (auto const &[ident, value]: opcodes) {
-            if (userStr == ident) {
-              opcodesCopy.erase(ident);
-              opcodeStr = toBinaryString(value, address.opcode_bits);
-              break;
-            }
-          }
-          error_if(opcodeStr.empty(),
-                   "opcode \"", userStr, "\" not declared in opcode section.");
-          insertIntoAddressString(opcodeStr, address.opcode_bits_start);
-        }
-        
-        // Insert cycle bits
-        userStr = lhs[1];
-        if (userStr != "x" && userStr != "X") {
-          std::string cycleStr;
-          int value;
-          error_if(!stringToInt(userStr, value),
-                   "cycle number (", userStr, ") is not a valid decimal number.");
-          
-          cycleStr = toBinaryString(value, address.cycle_bits);
-          error_if(cycleStr.length() > address.cycle_bits, 
-                   "cycle number (", value, ") does not fit inside ", address.cycle_bits, " bits");
-          
-          insertIntoAddressString(cycleStr, address.cycle_bits_start);
-        }
+        dependencies.push_back(id);
+        rule.insert(symbols.info[id].opcode, address.opcode_bits, address.opcode_bits_start);
+      }
+
+      // Insert cycle bits
+      userStr = lhs[1];
+      if (userStr != "x" && userStr != "X") {
+        int value;
+        error_if(!stringToInt(userStr, value),
+                 "cycle number (", userStr, ") is not a valid decimal number.");
+        error_if(value < 0 || static_cast<size_t>(value) >= (size_t{1} << address.cycle_bits),
+                 "cycle number (", value, ") does not fit inside ", address.cycle_bits, " bits");
+
+        rule.insert(value, address.cycle_bits, address.cycle_bits_start);
+      }
 
 	
-        // Insert flag bits
-        std::string flagStr = lhs[2];
+      // Insert flag bits
+      std::string_view flagStr = lhs[2];
+      std::string flagStates;
 	if (!flagStr.empty() && flagStr[0] == '(') {
 	  size_t endPos = flagStr.find(')');
-	  error_if(endPos == std::string::npos,
+	  error_if(endPos == std::string_view::npos,
 		   "expected ')' in state specification.");
 
 	  std::string result = std::string(address.flag_bits, 'x');
-	  std::vector<std::string> flagStates = split(flagStr.substr(1, endPos - 1), ',');
-	  for (std::string const &str: flagStates) {
-	    std::vector<std::string> state = split(str, '=');
+	  for (std::string_view str: split(flagStr.substr(1, endPos - 1), ',')) {
+	    std::vector<std::string_view> state = split(str, '=');
 	    error_if(state.size() != 2,
 		     "invalid format in state specification, should be of the form (A=0,B=1).");
 
-	    size_t flagIndex = -1;
-	    for (size_t idx = 0; idx != address.flag_labels.size(); ++idx) {
-	      if (state[0] == address.flag_labels[idx]) {
-		flagIndex = idx;
-		break;
-	      }
-	    }
-	    error_if(flagIndex == -1UL,
+	    uint32_t const id = symbols.find(state[0]);
+	    int const flagIndex = (id == SymbolTable::npos) ? -1 : symbols.info[id].flag;
+	    error_if(flagIndex == -1,
 		     "unknown flag identifier \"", state[0], "\".");
 
 
@@ -601,147 +1100,486 @@ namespace Mugen {
 	    result[flagIndex] = value ? '1' : '0';
 	  }
 
-	  flagStr.swap(result);
+	  flagStates.swap(result);
+	  flagStr = flagStates;
 	}
 	
-        error_if(flagStr.length() != address.flag_bits, 
-                 "number of flag bits (", flagStr.length(), ") does not match number of flag bits "
-                 "defined in the address section (", address.flag_bits, ").");
-        
-        if (!flagStr.empty()) {
-          for (char c: flagStr) { 
-            error_if(c != '0' && c != '1' && c != 'x' && c != 'X',
-                     "invalid flag bit '", c,"'; can only be 0, 1 or x (wildcard).");
-          }
-          
-          insertIntoAddressString(flagStr, address.flag_bits_start);
-        }
-        
-        // Check if this is a catchall scenario after all
-        for (char &c: addressString) {
-          if (c == 'X') c = 'x';
-        }
-        catchAll = (addressString == std::string(rom.address_bits, 'x'));
+      error_if(flagStr.length() != address.flag_bits, 
+               "number of flag bits (", flagStr.length(), ") does not match number of flag bits "
+               "defined in the address section (", address.flag_bits, ").");
+      
+      // The leftmost character of the flag-string corresponds to the most significant flag bit
+      for (size_t idx = 0; idx != flagStr.length(); ++idx) {
+        char const c = flagStr[idx];
+        error_if(c != '0' && c != '1' && c != 'x' && c != 'X',
+                 "invalid flag bit '", c,"'; can only be 0, 1 or x (wildcard).");
+
+        if (c == 'x' || c == 'X') continue;
+        size_t const bit = address.flag_bits - idx - 1;
+        rule.insert(c == '1', 1, address.flag_bits_start + bit);
       }
-      if (catchAll) catchRuleDefined = true;
 
+      // Check if this is a catchall scenario after all
+      catchAll = (rule.mask == 0);
+    }
 
-      // Replace macro's with their signals
-      std::vector<std::string> rhs = split(operands[1], ',');
-      bool done = false;
-      while (!done) {
-	std::vector<std::string> tmp;
-	done = true;
-	for (std::string const &ident: rhs) {
-	  if (macros.contains(ident)) {
-	    tmp.insert(tmp.end(), macros.at(ident).begin(), macros.at(ident).end());
-	    done = false;
-	  }
-	  else {
-	    tmp.push_back(ident);
-	  }
-	}
-	
-	rhs.swap(tmp);
-      }
 
-      // Construct control signal bitvector                   
-      size_t bitvector = 0;
-      for (std::string const &signal: rhs) {
-        bool validSignal = false;
-        for (size_t idx = 0; idx != signals.size(); ++idx) {
-          if (signals[idx] != signal) continue;
-          
-          bitvector |= (1 << idx);
-          signalsUsed[idx] = true;
-          validSignal = true;
-          break;
-        }
-	
-        error_if(!validSignal,
-                 "signal \"", signal, "\" not declared in signal or macro section.");
-      }
-      
-      
-      // Lambda that applies 'func' to each match of the address-string
-      auto for_each_match = [&addressString](auto const &func) {
-        auto impl = [&addressString, &func](auto const &self, size_t idx) {
-          if (idx == addressString.length()) return func(std::stoi(addressString, nullptr, 2));          
-          char &c = addressString[idx];
-          if (c == '0' || c == '1') {
-            self(self, idx + 1);
-          }
-          else if (c == 'x' || c == 'X') {
-            c = '0'; self(self, idx + 1);
-            c = '1'; self(self, idx + 1);
-            c = 'x';
-          }
-          else UNREACHABLE;
-        };
-        
-        return impl(impl, 0);
-      };
+    // Construct control signal bitvector; macros have been resolved into their signals already
+    uint64_t bitvector = 0;
+    for (std::string_view signal: split(operands[1], ',')) {
+      uint32_t const id = symbols.find(signal);
+      error_if(id == SymbolTable::npos || (symbols.info[id].signal == -1 && !symbols.info[id].isMacro),
+               "signal \"", signal, "\" not declared in signal or macro section.");
       
-      // Find all matching indices and assign the bitvectors to the images.
-      size_t nSegments = (1 << address.segment_bits);
-      for (size_t segment = 0; segment != nSegments; ++segment) {
-        
-        // If segmented, add segment bits into the address string
-        if (nSegments > 1) {
-          std::string segmentStr = toBinaryString(segment, address.segment_bits);
-          insertIntoAddressString(segmentStr, address.segment_bits_start);
-        }
-        
-        // Assign part of the bitvector to this segment (for each rom)
-        for_each_match([&](int idx) {
-          if (visited[idx]) {
-            error_if(!catchAll,
-                     "rule overlaps with rule previously defined on line ", visited[idx], ".");
-            return;
-          }
-          
-          for (size_t chip = 0; chip != rom.rom_count; ++chip) {
-            int chunkIdx = segment * rom.rom_count + chip;
-            unsigned char byte = (bitvector >> (8 * chunkIdx)) & 0xff;
-            images[chip][idx] = (opt.lsbFirst ? byte : reverseBits(byte));
-          }
-          visited[idx] = _lineNr;
-        });
-      }
-            
-      ++_lineNr;
+      auto const &info = symbols.info[id];
+      bitvector |= info.isMacro ? info.macro : (uint64_t{1} << info.signal);
+      dependencies.push_back(id);
     }
     
+    
+    rule.bitvector = bitvector;
+    rule.catchAll = catchAll;
+    return rule;
+  }
+  
+  // Compiles the lines of the microcode section using compile(line), which returns the rule
+  // for a single line. Lines following the catch rule are ignored.
+  template <typename Compile>
+  Rules compileRules(Body const &body, Compile &&compile) {
+    PhaseTimer timer("compileRules");
+    Rules rules;
+    bool catchRuleDefined = false;
+    int catchLineNr = 0;
+    
+    forEachLine(body, [&](std::string_view line) {
+      warning_if(catchRuleDefined,
+                 "rule is shadowed by the catch rule on line ", catchLineNr, " and will be ignored.");
+      if (catchRuleDefined) return;
+
+      append(rules, compile(line));
+      if (rules.hasCatch()) {
+        catchRuleDefined = true;
+        catchLineNr = _lineNr;
+      }
+    });
+    
+    return rules;
+  }
+  
+  // Warns about opcodes and signals that are not used by any of the rules; used is indexed by
+  // symbol id.
+  void checkUsage(Rules const &rules, std::vector<bool> const &used, Symbols const &symbols,
+                  Result const &result, Options const &opt) {
+    PhaseTimer timer("checkUsage");
+    
+    auto const &signals = result.signals;
+    bool const catchRuleDefined = rules.hasCatch();
+    
     // Raise a warning on unused opcodes
-    for (auto &pair: opcodesCopy)
-      warning("unused opcode \"", pair.first, "\".");
+    for (auto const &[ident, value]: result.opcodes)
+      warning_if(!used[symbols.find(ident)],
+                 "unused opcode \"", ident, "\".");
     
     // Raise a warning on unused signals
+    uint64_t signalsUsed = 0;
+    for (uint64_t const signals: rules.signals) signalsUsed |= signals;
     for (size_t idx = 0; idx != signals.size(); ++idx) 
-      warning_if(!signalsUsed[idx] && signals[idx] != s_empty,
+      warning_if(!(signalsUsed & (uint64_t{1} << idx)) && signals[idx] != s_empty,
                  "unused signal \"", signals[idx], "\".");
     
     // Raise a warning when padding with catch is enabled but no catch rule was defined
     error_if(!catchRuleDefined && opt.padImages == Options::Padding::CATCH,
              "no catch rule defined. This is mandatory when using '--pad catch'.");
-    
-    return images;                                                                                                                                  
   }
   
+  // The control words of the core image, indexed by logical address (the address without its
+  // segment bits), together with the addresses that have been written.
+  struct Arena {
+    ControlWords words;
+    Bitmap visited;
+    
+    Arena(size_t size):
+      words(size),
+      visited(size)
+    {}
+    
+    void clear() {
+      std::fill(words.begin(), words.end(), 0);
+      visited.clear();
+    }
+  };
+  
+  // Expands the rules into the arena, which covers the logical addresses starting at begin (a
+  // multiple of its size, which is a power of 2). Every entry holds the complete control word,
+  // which is split over the segments and chips afterwards. The rules are disjoint at this point,
+  // so they can be expanded concurrently; the catch rule is applied afterwards, in parallel over
+  // equal parts of the arena. The number of threads is limited by threadCount. When given, only
+  // the rules in 'selected' (indices, excluding the catch rule) are considered.
+  void expandRules(Rules const &rules, Result const &result, size_t nJobs, size_t begin, Arena &arena,
+                   std::vector<uint32_t> const *selected = nullptr, RuleProfiles *profile = nullptr) {
+    PhaseTimer timer("expandRules");
+    
+    auto const &address = result.address;
+    size_t const logicalBits = address.total_address_bits - address.segment_bits;
+    size_t const arenaSize = arena.words.size();
+    bool const catchRuleDefined = rules.hasCatch();
+    size_t const nRules = rules.size() - (catchRuleDefined ? 1 : 0);
+    size_t const nSelected = selected ? selected->size() : nRules;
+    size_t const ruleJobs = threadCount(nJobs, nSelected);
+    size_t const catchJobs = threadCount(nJobs, arenaSize);
+    
+    // The bits above the arena are fixed to those of begin; rules are restricted to them, and
+    // skipped entirely when they fix any of these bits to another value.
+    size_t const windowMask = ((size_t{1} << logicalBits) - 1) & ~(arenaSize - 1);
+    
+    // Every rule is profiled by a single thread, so the entries can be updated without locking
+    auto profiled = [profile](size_t idx, size_t thread, auto &&expand) {
+      if (!profile) return expand();
+      Clock::time_point const start = Clock::now();
+      expand();
+      RuleProfile &entry = (*profile)[idx];
+      if (entry.expandTime == Clock::duration{}) entry.expandBegin = start;
+      entry.expandTime += Clock::now() - start;
+      entry.thread = thread;
+    };
+    
+    parallelFor(nSelected, ruleJobs, [&](size_t sel, size_t thread) {
+      size_t const idx = selected ? (*selected)[sel] : sel;
+      Rule rule = removeSegmentBits(getRule(rules, idx), address);
+      if (((rule.value ^ begin) & rule.mask & windowMask) != 0) return;
+      
+      rule.mask |= windowMask;
+      rule.value = (rule.value & ~windowMask) | begin;
+      profiled(idx, thread, [&] {
+        expandRule(rule, logicalBits, begin, arena.words, arena.visited, ruleJobs > 1);
+      });
+    });
+    
+    if (catchRuleDefined) {
+      profiled(nRules, 0, [&] {
+        parallelFor(catchJobs, catchJobs, [&](size_t part, size_t) {
+          size_t const begin = arenaSize * part / catchJobs;
+          size_t const end = arenaSize * (part + 1) / catchJobs;
+          expandCatch(getRule(rules, nRules), begin, end, arena.words, arena.visited);
+        });
+      });
+    }
+  }
   
   void padImages(Result &result, unsigned char padValue) {
-    size_t padSize = (result.rom.word_count - result.images[0].size());
-    std::vector<unsigned char> const padVector(padSize, padValue);
+    size_t const coreSize = (size_t{1} << result.address.total_address_bits);
     
     for (auto &image: result.images) {
-      image.insert(image.end(), padVector.begin(), padVector.end());
+      std::fill(image.begin() + coreSize, image.end(), padValue);
+    }
+  }
+  
+  // When padding with the catch rule, every rule (including the catch itself) treats the unused
+  // high address bits as wildcards. The full image is therefore the core image repeated over the
+  // rom, which is constructed by doubling the filled part of each image until it is complete.
+  void tileImages(Result &result) {
+    size_t const coreSize = (size_t{1} << result.address.total_address_bits);
+    
+    for (auto &image: result.images) {
+      size_t const fullSize = image.size();
+      for (size_t size = coreSize; size < fullSize; size *= 2) {
+        std::memcpy(image.data() + size, image.data(), std::min(size, fullSize - size));
+      }
+    }
+  }
+  
+  void padImages(Result &result, Options const &opt) {
+    PhaseTimer timer("padImages");
+    if (opt.padImages == Options::Padding::VALUE) padImages(result, opt.padValue);
+    else if (opt.padImages == Options::Padding::CATCH) tileImages(result);
+  }
+  
+  // Builds the decision tree for a list of rules, in which the first rule that matches an address
+  // applies to it. A subtree covers the addresses that agree with the path to it on the bits tested
+  // so far (decided), and keeps the rules that match some of them, in order. When the first of these
+  // does not depend on any other bit, it matches the entire subtree. Otherwise, the subtree is split
+  // on one of the bits it depends on, preferably one that is fixed by most of the remaining rules;
+  // rules that do not fix this bit are passed to both halves.
+  RuleTree buildRuleTree(Rules const &rules) {
+    PhaseTimer timer("buildRuleTree");
+    RuleTree tree;
+    
+    auto build = [&](auto const &self, std::vector<uint32_t> const &ids, size_t decided) -> uint32_t {
+      uint32_t const node = tree.nodes.size();
+      tree.nodes.push_back({-1, -1, {0, 0}});
+      if (ids.empty()) return node;
+      
+      size_t const undecided = rules.mask[ids[0]] & ~decided;
+      if (undecided == 0) {
+        tree.nodes[node].rule = ids[0];
+        return node;
+      }
+      
+      // Prefer a bit that all remaining rules (apart from those that match the entire subtree) fix,
+      // so that no rules are passed to both halves
+      size_t common = ~size_t{0};
+      for (uint32_t id: ids) 
+        if ((rules.mask[id] & ~decided) != 0) common &= rules.mask[id];
+      
+      int bit = -1;
+      size_t best = 0;
+      if ((undecided & common) != 0) 
+        bit = std::bit_width(undecided & common) - 1;
+      else for (size_t bits = undecided; bits != 0; bits &= bits - 1) {
+        int const candidate = std::countr_zero(bits);
+        size_t const count = std::count_if(ids.begin(), ids.end(), [&](uint32_t id) {
+          return (rules.mask[id] >> candidate) & 1;
+        });
+        if (count > best) {
+          bit = candidate;
+          best = count;
+        }
+      }
+      
+      std::vector<uint32_t> halves[2];
+      for (uint32_t id: ids) {
+        bool const fixed = (rules.mask[id] >> bit) & 1;
+        bool const value = (rules.value[id] >> bit) & 1;
+        if (!fixed || !value) halves[0].push_back(id);
+        if (!fixed || value) halves[1].push_back(id);
+      }
+      
+      size_t const nextDecided = decided | (size_t{1} << bit);
+      uint32_t const zero = self(self, halves[0], nextDecided);
+      uint32_t const one = self(self, halves[1], nextDecided);
+      tree.nodes[node] = {bit, -1, {zero, one}};
+      return node;
+    };
+    
+    std::vector<uint32_t> ids(rules.size());
+    for (size_t idx = 0; idx != rules.size(); ++idx) ids[idx] = idx;
+    build(build, ids, 0);
+    return tree;
+  }
+  
+  // Calls func(first, last) for each of the disjoint ranges [first, last) of physical addresses
+  // that the logical addresses [begin, end) map onto, in ascending order. The range of logical
+  // addresses must be aligned to its size, which is a power of 2.
+  template <typename Function>
+  void forEachPhysicalRange(AddressMapping const &address, size_t begin, size_t end, Function &&func) {
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (size_t segment = 0; segment != (size_t{1} << address.segment_bits); ++segment) {
+      size_t const first = insertField(begin, segment, address.segment_bits, address.segment_bits_start);
+      size_t const last = insertField(end - 1, segment, address.segment_bits, address.segment_bits_start);
+      ranges.push_back({first, last + 1});
+    }
+    
+    // When segment bits lie within the range, the ranges of the segments overlap
+    std::sort(ranges.begin(), ranges.end());
+    size_t first = ranges[0].first;
+    size_t last = ranges[0].second;
+    for (auto const &range: ranges) {
+      if (range.first > last) {
+        func(first, last);
+        first = range.first;
+      }
+      last = std::max(last, range.second);
+    }
+    func(first, last);
+  }
+  
+  // Generates the images window by window, keeping only the control words of two windows of
+  // 2^chunkBits logical addresses in memory. While a window is transposed into the images (and
+  // mirrored when padding with the catch rule), the next one is expanded. Every range of the
+  // images that is complete is passed to opt.onChunk, which can write it out in the meantime.
+  // The provenance index can be as large as the images themselves, so it is not built; the rule
+  // tree is built instead. The rules are indexed by the window bits they fix, so that every window
+  // only visits the rules that intersect it.
+  void expandChunked(Rules const &rules, Result &result, Options const &opt) {
+    PhaseTimer timer("expandChunked");
+    RuleProfiles *profile = opt.profileRules ? &result.profile : nullptr;
+    
+    auto const &address = result.address;
+    size_t const logicalBits = address.total_address_bits - address.segment_bits;
+    size_t const windowBits = std::clamp<size_t>(opt.chunkBits, std::min<size_t>(4, logicalBits), logicalBits);
+    size_t const windowSize = size_t{1} << windowBits;
+    size_t const nWindows = size_t{1} << (logicalBits - windowBits);
+    size_t const coreSize = size_t{1} << address.total_address_bits;
+    size_t const fullSize = result.images[0].size();
+    size_t const nMirrors = (opt.padImages == Options::Padding::CATCH) ? fullSize / coreSize : 1;
+    
+    // For every distinct set of fixed window bits, the rules are grouped by the values of these bits
+    size_t const windowMask = ((size_t{1} << logicalBits) - 1) & ~(windowSize - 1);
+    size_t const nRules = rules.size() - (rules.hasCatch() ? 1 : 0);
+    std::map<size_t, std::unordered_map<size_t, std::vector<uint32_t>>> index;
+    for (size_t idx = 0; idx != nRules; ++idx) {
+      Rule const rule = removeSegmentBits(getRule(rules, idx), address);
+      size_t const mask = rule.mask & windowMask;
+      index[mask][rule.value & mask].push_back(idx);
+    }
+    
+    auto select = [&](size_t begin, std::vector<uint32_t> &selected) {
+      selected.clear();
+      for (auto const &[mask, groups]: index) {
+        auto it = groups.find(begin & mask);
+        if (it != groups.end()) selected.insert(selected.end(), it->second.begin(), it->second.end());
+      }
+    };
+    
+    auto complete = [&](size_t first, size_t last) {
+      if (opt.onChunk) opt.onChunk(first, last);
+    };
+    
+    auto consume = [&](Arena const &arena, size_t begin) {
+      size_t const end = begin + windowSize;
+      transposeControlWords(arena.words, begin, begin, end, result, opt.lsbFirst, result.images);
+      
+      forEachPhysicalRange(address, begin, end, [&](size_t first, size_t last) {
+        for (size_t mirror = 0; mirror != nMirrors; ++mirror) {
+          size_t const offset = mirror * coreSize;
+          for (auto &image: result.images) 
+            if (offset != 0) std::memcpy(image.data() + offset + first, image.data() + first, last - first);
+          complete(offset + first, offset + last);
+        }
+      });
+    };
+    
+    Arena arenas[2] = {Arena(windowSize), Arena(windowSize)};
+    std::vector<uint32_t> selected;
+    std::future<void> pending;
+    for (size_t window = 0; window != nWindows; ++window) {
+      Arena &arena = arenas[window % 2];
+      if (window > 1) arena.clear();
+      select(window * windowSize, selected);
+      expandRules(rules, result, std::max<size_t>(opt.jobs, 1), window * windowSize, arena, &selected, profile);
+      
+      if (pending.valid()) pending.get();
+      pending = std::async(std::launch::async, consume, std::cref(arena), window * windowSize);
+    }
+    pending.get();
+    
+    if (opt.padImages == Options::Padding::VALUE) {
+      size_t const step = windowSize << address.segment_bits;
+      for (size_t first = coreSize; first < fullSize; first += step) {
+        size_t const last = std::min(first + step, fullSize);
+        for (auto &image: result.images) 
+          std::fill(image.begin() + first, image.begin() + last, opt.padValue);
+        complete(first, last);
+      }
+    }
+  }
+  
+  // Fills in the addresses matched and written by every rule. The rules do not overlap, so every
+  // rule except the catch rule writes all addresses it matches; the catch rule writes the rest.
+  RuleProfiles countCoverage(Rules const &rules, AddressMapping const &address, RuleProfiles profile) {
+    size_t const logicalBits = address.total_address_bits - address.segment_bits;
+    size_t written = 0;
+    for (size_t idx = 0; idx != rules.size(); ++idx) {
+      RuleProfile &entry = profile[idx];
+      entry.wildcardBits = logicalBits - std::popcount(rules.mask[idx]);
+      entry.matched = size_t{1} << entry.wildcardBits;
+      entry.written = rules.catchAll[idx] ? entry.matched - written : entry.matched;
+      written += entry.written;
+    }
+    return profile;
+  }
+  
+  void parseMicrocode(Body const &body, Result &result, Symbols const &symbols, Options const &opt) {
+    
+    auto const &address = result.address;
+    std::vector<bool> used(symbols.table.size());
+    
+    Dependencies dependencies;
+    RuleProfiles profile;
+    Rules rules = compileRules(body, [&](std::string_view line) {
+      Clock::time_point const start = opt.profileRules ? Clock::now() : Clock::time_point{};
+      dependencies.clear();
+      Rule rule = compileRule(line, result, symbols, dependencies);
+      for (uint32_t id: dependencies) used[id] = true;
+      
+      if (opt.profileRules) {
+        RuleProfile &entry = profile.emplace_back();
+        entry.lineNr = rule.lineNr;
+        for (uint32_t id: dependencies) entry.macroDepth = std::max(entry.macroDepth, symbols.info[id].macroDepth);
+        entry.compileTime = Clock::now() - start;
+      }
+      return rule;
+    });
+    
+    // Check the rules for overlap before writing anything to the images. Only the core image
+    // is generated; with '--pad catch', it is mirrored over the unused address bits afterwards
+    // (see tileImages).
+    int const endLineNr = _lineNr;
+    validateRules(rules, address, address.total_address_bits);
+    _lineNr = endLineNr;
+    if (opt.profileRules) result.profile = countCoverage(rules, address, std::move(profile));
+    RuleProfiles *const profiled = opt.profileRules ? &result.profile : nullptr;
+    
+    if (!opt.generateImages || opt.chunkBits > 0) {
+      checkUsage(rules, used, symbols, result, opt);
+      if (opt.generateImages) {
+        result.images = allocateImages(result, opt);
+        expandChunked(rules, result, opt);
+      }
+      result.tree = buildRuleTree(rules);
+      result.rules = std::move(rules);
+      return;
+    }
+    
+    size_t const arenaSize = (size_t{1} << (address.total_address_bits - address.segment_bits));
+    Arena arena(arenaSize);
+    expandRules(rules, result, std::max<size_t>(opt.jobs, 1), 0, arena, nullptr, profiled);
+    checkUsage(rules, used, symbols, result, opt);
+    
+    result.images = allocateImages(result, opt);
+    {
+      PhaseTimer timer("transposeControlWords");
+      transposeControlWords(arena.words, 0, 0, arenaSize, result, opt.lsbFirst, result.images);
     }
+    padImages(result, opt);
+    
+    bool const catchRuleDefined = rules.hasCatch();
+    size_t const nRules = rules.size() - (catchRuleDefined ? 1 : 0);
+    {
+      PhaseTimer timer("buildProvenance");
+      result.provenance = buildProvenance(rules, address, nRules, catchRuleDefined ? nRules : -1);
+    }
+    result.rules = std::move(rules);
+  }
+  
+  
+  int ruleAt(Result const &result, size_t address) {
+    auto const &provenance = result.provenance;
+    
+    // Addresses outside the core image are mirrors of the core when padded with the catch rule
+    size_t const coreBits = result.address.total_address_bits;
+    if ((address >> coreBits) != 0) {
+      if (result.padding != Options::Padding::CATCH) return -1;
+      address &= (size_t{1} << coreBits) - 1;
+    }
+    
+    if (provenance.empty()) return result.tree.find(address);
+    size_t const logical = removeField(address, result.address.segment_bits, result.address.segment_bits_start);
+    auto it = std::upper_bound(provenance.begin(), provenance.end(), logical,
+                               [](size_t addr, ProvenanceSpan const &span) {
+                                 return addr < span.start;
+                               });
+    return (it == provenance.begin()) ? -1 : std::prev(it)->rule;
+  }
+  
+  int ruleLineAt(Result const &result, size_t address) {
+    int const rule = ruleAt(result, address);
+    return (rule < 0) ? 0 : result.rules.lineNr[rule];
+  }
+  
+  uint64_t controlWordAt(Result const &result, size_t address) {
+    int const rule = ruleAt(result, address);
+    return (rule < 0) ? 0 : result.rules.signals[rule];
+  }
+  
+  size_t imageSize(Result const &result) {
+    return imageSize(result, result.padding);
   }
   
   std::string layoutReport(Result const &result) {
     
     std::ostringstream oss;
-    size_t nSegments = (1 << result.address.segment_bits);
+    size_t nSegments = (size_t{1} << result.address.segment_bits);
     for (size_t i = 0; i != result.rom.rom_count; ++i) {
       for (size_t j = 0; j != nSegments; ++j) {
         size_t chunkIdx = 8 * (j * result.rom.rom_count + i);
@@ -782,59 +1620,302 @@ namespace Mugen {
   
   
   
-  Result generate(std::string const &filename, Options const &opt) {
-    
-    std::ifstream file(filename);
-    error_if(!file,
-             "could not open file \"", filename, "\".");
+  // Warns about unknown sections and raises an error when a required section is missing
+  void checkSections(std::unordered_map<std::string, Body> const &sections) {
+    std::vector<std::string> const requiredSections{
+      "rom", "signals", "opcodes", "address", "microcode"
+    };
     
-    _file = filename;
-    std::unordered_map<std::string, bool> requiredSections{
-      {"rom", false},
-      {"signals", false},
-      {"opcodes", false},
-      {"address", false},
-      {"microcode", false}
+    std::vector<std::string> const optionalSections{
+      "macros"
     };
-
-    std::unordered_map<std::string, bool> optionalSections{
-      {"macros", false}
+    
+    auto contains = [](std::vector<std::string> const &names, std::string const &name) {
+      return std::find(names.begin(), names.end(), name) != names.end();
     };
     
-    auto sections = parseTopLevel(file);
     for (auto const &[name, body]: sections) {
-      if (requiredSections.contains(name)) {
-        requiredSections[name] = true;
-      }
-      else if (optionalSections.contains(name)) {
-        optionalSections[name] = true;
-      }
-      else {
+      if (!contains(requiredSections, name) && !contains(optionalSections, name)) {
         _lineNr = body.lineNr;
         warning("ignoring unknown section \"", name, "\".");
       }
     }
     
     _lineNr = 0;
-    for (auto const &[name, defined]: requiredSections) {
-      error_if(!defined,
+    for (auto const &name: requiredSections) {
+      error_if(!sections.contains(name),
                "missing section: \"", name, "\".");
     }
-    
+  }
+  
+  // Parses every section except the microcode
+  Result parseDefinitions(std::unordered_map<std::string, Body> &sections, Symbols &symbols) {
     Result result;
     result.rom      = parseRomSpecs(sections["rom"]);
-    result.address  = parseAddressMapping(sections["address"], result);
-    result.signals  = parseSignals(sections["signals"], result);
-    if (optionalSections["macros"])
-	result.macros   = parseMacros(sections["macros"], result);
-    result.opcodes  = parseOpcodes(sections["opcodes"], result);
-    result.images   = parseMicrocode(sections["microcode"], result, opt);
-    result.lsbFirst = opt.lsbFirst;
+    result.address  = parseAddressMapping(sections["address"], result, symbols);
+    result.signals  = parseSignals(sections["signals"], result, symbols);
+    if (sections.contains("macros"))
+	result.macros   = parseMacros(sections["macros"], symbols);
+    result.opcodes  = parseOpcodes(sections["opcodes"], result, symbols);
+    return result;
+  }
+  
+  
+  Result generate(std::string const &filename, Options const &opt) {
     
-    result.specificationFilename = filename;
+    ParserScope scope(filename, opt);
+    MappedFile file(filename);
+    error_if(!file,
+             "could not open file \"", filename, "\".");
     
-    if (opt.padImages == Options::Padding::VALUE) padImages(result, opt.padValue);
+    return generateFromSource(file.view(), filename, opt);
+  }
+  
+  Result generateFromSource(std::string_view source, std::string const &name, Options const &opt) {
+    
+    ParserScope scope(name, opt);
+    error_if(opt.jobs > Options::MaxJobs,
+             "number of jobs (", opt.jobs, ") exceeds the maximum of ", Options::MaxJobs, ".");
+    
+    auto sections = parseTopLevel(source);
+    checkSections(sections);
+    
+    Symbols symbols;
+    Result result = parseDefinitions(sections, symbols);
+    try {
+      parseMicrocode(sections["microcode"], result, symbols, opt);
+    }
+    catch (std::system_error const &e) {
+      _lineNr = 0;
+      error("could not start worker threads (", e.what(), "); try fewer jobs.");
+    }
+    result.lsbFirst = opt.lsbFirst;
+    result.padding  = opt.padImages;
+    
+    result.specificationFilename = name;
     return result;
   }
   
+  // Incremental regeneration keeps the state of the previous update: the hashes of the sections,
+  // the compiled rules (cached by their text), the control words and which of them were written
+  // by a rule other than the catch rule. After an edit, only the rules that were added, changed or removed are written
+  // again, and only the blocks of the images containing those addresses are transposed.
+  struct IncrementalGenerator::State {
+    
+    struct CachedRule {
+      Rule rule;
+      Dependencies dependencies;
+    };
+    
+    static constexpr size_t BlockSize = 64;
+    
+    std::string filename;
+    Options opt;
+    bool initialized = false;
+    Result result;
+    
+    std::unordered_map<std::string, size_t> hashes;
+    Symbols symbols;
+    StringMap<CachedRule> cache;
+    
+    // Control words of the rules that are currently written to the images, keyed by their
+    // (mask, value) pair
+    std::map<std::pair<size_t, size_t>, uint64_t> live;
+    uint64_t catchWord = 0;
+    
+    ControlWords words;
+    Bitmap written{0};
+  };
+  
+  IncrementalGenerator::IncrementalGenerator(std::string const &filename, Options const &opt):
+    _state(std::make_unique<State>())
+  {
+    _state->filename = filename;
+    _state->opt = opt;
+  }
+  
+  IncrementalGenerator::~IncrementalGenerator() = default;
+  
+  Result const &IncrementalGenerator::result() const {
+    return _state->result;
+  }
+  
+  Result const &IncrementalGenerator::update() {
+    State &state = *_state;
+    Options const &opt = state.opt;
+    
+    ParserScope scope(state.filename, opt);
+    MappedFile file(state.filename);
+    error_if(!file,
+             "could not open file \"", state.filename, "\".");
+    
+    auto sections = parseTopLevel(file.view());
+    checkSections(sections);
+    
+    // The layout of the images depends on the rom and address sections; when these change,
+    // everything is generated from scratch. Other definitions are only parsed again when
+    // their sections changed.
+    std::unordered_map<std::string, size_t> hashes;
+    for (std::string const name: {"rom", "address", "signals", "macros", "opcodes"}) {
+      auto it = sections.find(name);
+      hashes[name] = (it == sections.end()) ? 0 : std::hash<std::string_view>{}(it->second.str);
+    }
+    
+    bool const reset = !state.initialized
+      || hashes["rom"] != state.hashes["rom"]
+      || hashes["address"] != state.hashes["address"];
+    
+    // Names keep their ids across updates, so that the dependencies of cached rules stay
+    // valid; an id is marked as changed when any of its meanings changed.
+    Result next;
+    Symbols symbols = state.symbols;
+    std::vector<bool> changed;
+    if (reset || hashes != state.hashes) {
+      std::fill(symbols.info.begin(), symbols.info.end(), Symbols::Info{});
+      next = parseDefinitions(sections, symbols);
+      
+      changed.resize(state.symbols.info.size());
+      for (size_t id = 0; id != changed.size(); ++id)
+        changed[id] = (symbols.info[id] != state.symbols.info[id]);
+    }
+    else {
+      next.rom     = state.result.rom;
+      next.address = state.result.address;
+      next.signals = state.result.signals;
+      next.macros  = state.result.macros;
+      next.opcodes = state.result.opcodes;
+    }
+    
+    // Rules are only compiled again when their text changed or when they depend on a definition
+    // that changed.
+    StringMap<State::CachedRule> cache;
+    std::vector<bool> used(symbols.table.size());
+    
+    Rules rules = compileRules(sections["microcode"], [&](std::string_view line) {
+      State::CachedRule entry;
+      auto it = state.cache.find(line);
+      bool const valid = !reset && it != state.cache.end()
+        && std::none_of(it->second.dependencies.begin(), it->second.dependencies.end(),
+                        [&changed](uint32_t id) { return id < changed.size() && changed[id]; });
+      
+      if (valid) entry = it->second;
+      else entry.rule = compileRule(line, next, symbols, entry.dependencies);
+      
+      entry.rule.lineNr = _lineNr;
+      for (uint32_t id: entry.dependencies) used[id] = true;
+      cache[std::string(line)] = entry;
+      return entry.rule;
+    });
+    
+    // Everything that could fail is checked before the state is modified, so that the result
+    // of the previous update remains valid when an error is found.
+    int const endLineNr = _lineNr;
+    validateRules(rules, next.address, next.address.total_address_bits);
+    _lineNr = endLineNr;
+    checkUsage(rules, used, symbols, next, opt);
+    
+    auto const &address = next.address;
+    size_t const logicalBits = address.total_address_bits - address.segment_bits;
+    size_t const arenaSize = (size_t{1} << logicalBits);
+    size_t const blockSize = std::min(State::BlockSize, arenaSize);
+    Bitmap dirty(arenaSize / blockSize);
+    
+    if (reset) {
+      state.words.assign(arenaSize, 0);
+      state.written = Bitmap(arenaSize);
+      state.live.clear();
+      state.catchWord = 0;
+      state.result.images = allocateImages(next, opt);
+      dirty.set(0, arenaSize / blockSize);
+    }
+    
+    state.result.rom      = std::move(next.rom);
+    state.result.address  = std::move(next.address);
+    state.result.signals  = std::move(next.signals);
+    state.result.macros   = std::move(next.macros);
+    state.result.opcodes  = std::move(next.opcodes);
+    state.result.lsbFirst = opt.lsbFirst;
+    state.result.padding  = opt.padImages;
+    state.result.specificationFilename = state.filename;
+    
+    // Writes word to every address matched by rule, marking the blocks it touches. The addresses
+    // are marked as written unless the word is that of the catch rule.
+    auto write = [&](Rule const &rule, uint64_t word, bool owned) {
+      forEachRun(removeSegmentBits(rule, state.result.address), logicalBits, [&](Run const &run) {
+        for (size_t i = 0; i != run.count; ++i) {
+          size_t const idx = run.start + i * run.stride;
+          state.words[idx] = word;
+          if (owned) state.written.set(idx);
+          else state.written.reset(idx);
+        }
+        size_t const first = run.start / blockSize;
+        size_t const last = (run.start + (run.count - 1) * run.stride) / blockSize;
+        if (run.stride == 1) dirty.set(first, last - first + 1);
+        else for (size_t i = 0; i != run.count; ++i) dirty.set((run.start + i * run.stride) / blockSize);
+      });
+    };
+    
+    bool const catchRuleDefined = rules.hasCatch();
+    size_t const nRules = rules.size() - (catchRuleDefined ? 1 : 0);
+    uint64_t const catchWord = catchRuleDefined ? rules.signals[nRules] : 0;
+    int const catchRule = catchRuleDefined ? nRules : -1;
+    
+    // Rules that are still present (possibly at another index) are kept as they are
+    std::map<std::pair<size_t, size_t>, uint64_t> live;
+    std::vector<size_t> added;
+    for (size_t idx = 0; idx != nRules; ++idx) {
+      auto it = state.live.find({rules.mask[idx], rules.value[idx]});
+      if (it != state.live.end() && it->second == rules.signals[idx]) {
+        live.insert(*it);
+        state.live.erase(it);
+      }
+      else added.push_back(idx);
+    }
+    
+    // The remaining rules have been removed or changed; their addresses fall back to the catch rule
+    for (auto const &[key, entry]: state.live) {
+      Rule rule;
+      rule.mask = key.first;
+      rule.value = key.second;
+      write(rule, catchWord, false);
+    }
+    
+    if (catchWord != state.catchWord) {
+      for (size_t idx = 0; idx != arenaSize; ++idx) {
+        if (state.written.test(idx) || state.words[idx] == catchWord) continue;
+        state.words[idx] = catchWord;
+        dirty.set(idx / blockSize);
+      }
+    }
+    
+    for (size_t idx: added) {
+      live.insert({{rules.mask[idx], rules.value[idx]}, rules.signals[idx]});
+      write(getRule(rules, idx), rules.signals[idx], true);
+    }
+    
+    // Transpose the dirty blocks into the images and pad them again if necessary
+    size_t const nBlocks = arenaSize / blockSize;
+    for (size_t first = dirty.find(0, nBlocks, true); first != nBlocks; ) {
+      size_t const last = dirty.find(first, nBlocks, false);
+      transposeControlWords(state.words, 0, first * blockSize, last * blockSize,
+                            state.result, opt.lsbFirst, state.result.images);
+      first = dirty.find(last, nBlocks, true);
+    }
+    
+    if (reset) padImages(state.result, opt);
+    else if (opt.padImages == Options::Padding::CATCH && dirty.find(0, nBlocks, true) != nBlocks)
+      tileImages(state.result);
+    
+    state.result.provenance = buildProvenance(rules, state.result.address, nRules, catchRule);
+    state.result.rules = std::move(rules);
+    
+    state.hashes = std::move(hashes);
+    state.symbols = std::move(symbols);
+    state.cache = std::move(cache);
+    state.live = std::move(live);
+    state.catchWord = catchWord;
+    state.initialized = true;
+    return state.result;
+  }
+  
 } // namespace Mugen
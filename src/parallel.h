@@ -0,0 +1,116 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+
+// Number of threads used for count work items when 'jobs' threads are requested: never more than
+// there are items or than the hardware can run at once (when known), and at least one.
+inline size_t threadCount(size_t jobs, size_t count) {
+  size_t const hardware = std::thread::hardware_concurrency();
+  return std::max<size_t>(std::min({jobs, count, hardware ? hardware : jobs}), 1);
+}
+
+// Calls func(index, thread) for every index in [0, count), distributing the indices dynamically
+// over at most 'jobs' threads (see threadCount). The calling thread takes part as thread 0; the
+// call returns when all indices have been processed. When a thread can not be started, the
+// threads that did start finish the work and std::system_error is thrown afterwards.
+template <typename Function>
+void parallelFor(size_t count, size_t jobs, Function &&func) {
+  jobs = threadCount(jobs, count);
+  if (jobs <= 1) {
+    for (size_t idx = 0; idx != count; ++idx) func(idx, 0);
+    return;
+  }
+  
+  std::atomic<size_t> next = 0;
+  auto worker = [&](size_t thread) {
+    for (size_t idx = next++; idx < count; idx = next++) func(idx, thread);
+  };
+  
+  std::vector<std::jthread> threads;
+  for (size_t thread = 1; thread < jobs; ++thread)
+    threads.emplace_back(worker, thread);
+  worker(0);
+}
+
+// Pool of worker threads that run the submitted tasks in order of submission, taking them from a
+// single shared queue. Meant for coarse tasks (e.g. complete builds), for which contention on the
+// queue is negligible.
+class ThreadPool {
+  std::deque<std::function<void()>> _tasks;
+  std::vector<std::jthread> _threads;
+  std::mutex _mutex;
+  std::condition_variable _available;
+  std::condition_variable _finished;
+  size_t _unfinished = 0; // tasks not yet completed
+  bool _stop = false;
+  
+  void run() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock lock(_mutex);
+        _available.wait(lock, [this] { return !_tasks.empty() || _stop; });
+        if (_tasks.empty()) return;
+        task = std::move(_tasks.front());
+        _tasks.pop_front();
+      }
+      
+      task();
+      
+      std::lock_guard lock(_mutex);
+      if (--_unfinished == 0) _finished.notify_all();
+    }
+  }
+  
+  void stop() {
+    {
+      std::lock_guard lock(_mutex);
+      _stop = true;
+    }
+    _available.notify_all();
+    _threads.clear(); // join before the synchronization members are destroyed
+  }
+  
+public:
+  // Throws std::system_error when a thread can not be started
+  ThreadPool(size_t nThreads) {
+    nThreads = std::max<size_t>(nThreads, 1);
+    try {
+      for (size_t idx = 0; idx != nThreads; ++idx)
+        _threads.emplace_back([this] { run(); });
+    }
+    catch (...) {
+      stop();
+      throw;
+    }
+  }
+  
+  ~ThreadPool() {
+    stop();
+  }
+  
+  void submit(std::function<void()> task) {
+    {
+      std::lock_guard lock(_mutex);
+      _tasks.push_back(std::move(task));
+      ++_unfinished;
+    }
+    _available.notify_one();
+  }
+  
+  // Blocks until all submitted tasks have completed
+  void wait() {
+    std::unique_lock lock(_mutex);
+    _finished.wait(lock, [this] { return _unfinished == 0; });
+  }
+};
+
+#endif
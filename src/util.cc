@@ -1,43 +1,114 @@
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "util.h"
 
-void trim(std::string &str) {
-  size_t idx = 0;
-  while (idx < str.length() && std::isspace(str[idx])) { ++idx; }
-  if (idx == str.length()) {
-    str.clear();
-    return;
-  }
-        
-  size_t const start = idx;
-  idx = str.length() - 1;
-  while (idx >= 0 && std::isspace(str[idx])) { --idx; }
-  size_t const stop = idx;
-        
-  str = str.substr(start, stop - start + 1);
+std::string_view trim(std::string_view str) {
+  size_t start = 0;
+  while (start < str.size() && std::isspace(str[start])) { ++start; }
+  
+  size_t stop = str.size();
+  while (stop > start && std::isspace(str[stop - 1])) { --stop; }
+  
+  return str.substr(start, stop - start);
 }
 
-std::vector<std::string> split(std::string const &str, char const c, bool allowEmpty) {
-  return split(str, std::string{c}, allowEmpty);
+std::vector<std::string_view> split(std::string_view str, char const c, bool allowEmpty) {
+  return split(str, std::string_view{&c, 1}, allowEmpty);
 }
 
-std::vector<std::string> split(std::string const &str, std::string const &token, bool allowEmpty) {
-  std::vector<std::string> result;
+std::vector<std::string_view> split(std::string_view str, std::string_view token, bool allowEmpty) {
+  std::vector<std::string_view> result;
 
   size_t prev = 0;
   size_t current = 0;
-  while ((current = str.find(token, prev)) != std::string::npos) {
-    std::string part = str.substr(prev, current - prev);
-    trim(part);
+  while ((current = str.find(token, prev)) != std::string_view::npos) {
+    std::string_view part = trim(str.substr(prev, current - prev));
     if (allowEmpty || !part.empty()) result.push_back(part);
     prev = current + token.length();
   }
-  std::string last = str.substr(prev);
-  trim(last);
+  std::string_view last = trim(str.substr(prev));
   if (allowEmpty || !last.empty()) result.push_back(last);
 
   return result;
 }
 
+MappedFile::MappedFile(std::string const &filename) {
+  int const fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  
+  struct stat info;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+    _size = info.st_size;
+    if (_size == 0) _valid = true;
+    else {
+      void *ptr = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr != MAP_FAILED) {
+        _data = static_cast<char const *>(ptr);
+        _mapped = _valid = true;
+      }
+    }
+  }
+  close(fd);
+  if (_valid) return;
+  
+  // Not a regular file or mapping failed: read it into a buffer instead
+  std::ifstream file(filename, std::ios::binary);
+  if (!file) return;
+  _buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  _data = _buffer.data();
+  _size = _buffer.size();
+  _valid = true;
+}
+
+MappedFile::~MappedFile() {
+  if (_mapped) munmap(const_cast<char *>(_data), _size);
+}
+
+size_t SymbolTable::probe(std::string_view name, size_t hash) const {
+  size_t const mask = _slots.size() - 1;
+  for (size_t idx = hash & mask; ; idx = (idx + 1) & mask) {
+    uint32_t const entry = _slots[idx];
+    if (entry == 0) return idx;
+    if (_hashes[entry - 1] == hash && _names[entry - 1] == name) return idx;
+  }
+}
+
+void SymbolTable::rehash(size_t capacity) {
+  _slots.assign(capacity, 0);
+  size_t const mask = capacity - 1;
+  for (size_t id = 0; id != _names.size(); ++id) {
+    size_t idx = _hashes[id] & mask;
+    while (_slots[idx] != 0) idx = (idx + 1) & mask;
+    _slots[idx] = id + 1;
+  }
+}
+
+uint32_t SymbolTable::insert(std::string_view name) {
+  if (2 * (_names.size() + 1) > _slots.size()) 
+    rehash(std::max<size_t>(16, 2 * _slots.size()));
+  
+  size_t const hash = std::hash<std::string_view>{}(name);
+  size_t const idx = probe(name, hash);
+  if (_slots[idx] != 0) return _slots[idx] - 1;
+  
+  _names.emplace_back(name);
+  _hashes.push_back(hash);
+  _slots[idx] = _names.size();
+  return _names.size() - 1;
+}
+
+uint32_t SymbolTable::find(std::string_view name) const {
+  if (_slots.empty()) return npos;
+  return _slots[probe(name, std::hash<std::string_view>{}(name))] - 1;
+}
+
 std::string toBinaryString(size_t num, size_t minBits) {
   std::string binary = std::bitset<64>(num).to_string();
   size_t firstOne = binary.find('1');
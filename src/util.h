@@ -2,26 +2,98 @@
 #define UTIL_H
 
 #include <iostream>
+#include <string>
+#include <string_view>
 #include <vector>
+#include <cstdint>
 #include <bitset>
+#include <charconv>
 #include <cassert>
+#include <new>
 
-void trim(std::string &str);
-std::vector<std::string> split(std::string const &str, char const c, bool allowEmpty = false);
-std::vector<std::string> split(std::string const &str, std::string const &token, bool allowEmpty = false);
+std::string_view trim(std::string_view str);
+std::vector<std::string_view> split(std::string_view str, char const c, bool allowEmpty = false);
+std::vector<std::string_view> split(std::string_view str, std::string_view token, bool allowEmpty = false);
 std::string toBinaryString(size_t num, size_t minBits);
 
+// Accepts the same format as std::stoi: an optional sign and, in base 16, an optional 0x prefix.
+// Fails when the value does not fit in Int (including negative values for unsigned types).
 template <typename Int>
-bool stringToInt(std::string const &str, Int &result, int base = 10) {
-  size_t pos;
-  try {
-    result = std::stoi(str, &pos, base); }
-  catch (...) {
-    return false;
-  }
-  return (pos == str.size());
+bool stringToInt(std::string_view str, Int &result, int base = 10) {
+  if (!str.empty() && str[0] == '+') str.remove_prefix(1);
+  if (base == 16 && str.size() > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) str.remove_prefix(2);
+  
+  Int value{};
+  char const *end = str.data() + str.size();
+  auto [ptr, ec] = std::from_chars(str.data(), end, value, base);
+  if (str.empty() || ec != std::errc{} || ptr != end) return false;
+  
+  result = value;
+  return true;
 }
 
+// Read-only view of the contents of a file, which is mapped into memory when possible
+class MappedFile {
+  char const *_data = nullptr;
+  size_t _size = 0;
+  bool _mapped = false;
+  bool _valid = false;
+  std::string _buffer;
+  
+public:
+  explicit MappedFile(std::string const &filename);
+  ~MappedFile();
+  MappedFile(MappedFile const &) = delete;
+  MappedFile &operator=(MappedFile const &) = delete;
+  
+  explicit operator bool() const { return _valid; }
+  std::string_view view() const { return {_data, _size}; }
+};
+
+// Allocator for containers whose data must be aligned beyond the default alignment
+template <typename T, size_t Alignment>
+struct AlignedAllocator {
+  using value_type = T;
+  
+  template <typename U>
+  struct rebind { using other = AlignedAllocator<U, Alignment>; };
+  
+  AlignedAllocator() = default;
+  template <typename U>
+  AlignedAllocator(AlignedAllocator<U, Alignment> const &) {}
+  
+  T *allocate(size_t n) {
+    return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{Alignment}));
+  }
+  
+  void deallocate(T *ptr, size_t) {
+    ::operator delete(ptr, std::align_val_t{Alignment});
+  }
+  
+  template <typename U>
+  bool operator==(AlignedAllocator<U, Alignment> const &) const { return true; }
+};
+
+// Assigns dense ids (0, 1, 2, ...) to names in order of insertion. Names are looked up in an
+// open-addressed hash table with linear probing, which is kept at most half full.
+class SymbolTable {
+  std::vector<std::string> _names;
+  std::vector<size_t> _hashes;
+  std::vector<uint32_t> _slots; // id + 1 of the name in each slot, 0 when empty
+  
+  size_t probe(std::string_view name, size_t hash) const;
+  void rehash(size_t capacity);
+  
+public:
+  static constexpr uint32_t npos = ~uint32_t{0};
+  
+  uint32_t insert(std::string_view name);
+  uint32_t find(std::string_view name) const;
+  
+  std::string const &name(uint32_t id) const { return _names[id]; }
+  size_t size() const { return _names.size(); }
+};
+
 size_t bitsNeeded(size_t n);
 unsigned char reverseBits(unsigned char byte);
 